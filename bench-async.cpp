@@ -0,0 +1,245 @@
+//--------------------------------------------------------------------------------------------------
+/*! Throughput and latency of Editor::AsyncCommand(), with several threads sending commands to an
+ *  editor running on a pseudo-terminal, against the same load on LockedFifo, the mutex and deque
+ *  the editor used to queue commands with, woken through a pipe once per command as it was.
+ *
+ *  Usage: bench-async [producers [commands per producer]], by default 4 and 200000.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "redline/bindings.hpp"
+#include "redline/command.hpp"
+#include "redline/editor.hpp"
+#include "redline/emacs.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace
+{
+  long long Microseconds()
+  {
+    timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1000000LL + now.tv_usec;
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! The queue Editor::AsyncCommand() used before AsyncQueue.
+   */
+  //------------------------------------------------------------------------------------------------
+  template<typename T>
+  class LockedFifo
+  {
+  public:
+    LockedFifo()
+    {
+      pthread_mutex_init(&mutex, 0);
+    }
+    ~LockedFifo()
+    {
+      pthread_mutex_destroy(&mutex);
+    }
+    void Push(T t) throw()
+    {
+      pthread_mutex_lock(&mutex);
+      fifo.push_back(t);
+      pthread_mutex_unlock(&mutex);
+    }
+    bool Pop(T &t) throw()
+    {
+      pthread_mutex_lock(&mutex);
+      bool result = false;
+      if (!fifo.empty())
+      {
+        t = fifo.front();
+        fifo.pop_front();
+        result = true;
+      }
+      pthread_mutex_unlock(&mutex);
+      return result;
+    }
+  private:
+    pthread_mutex_t mutex;
+    std::deque<T> fifo;
+  };
+
+  //! A run of the benchmark. Commands are counted, and their latency noted, on the taker's thread.
+  struct Run
+  {
+    Run(int _producers, int _perProducer) :
+      producers(_producers), perProducer(_perProducer), ran(), latencies(), editor(), fifo(),
+      wakeFd()
+    {
+      latencies.reserve(producers * perProducer);
+    }
+
+    int producers, perProducer;
+    long ran;
+    std::vector<long long> latencies;
+
+    //! Where the commands go: the editor, or the old queue and its pipe.
+    Redline::Editor *editor;
+    LockedFifo<const Redline::Command *> *fifo;
+    int wakeFd[2];
+  };
+
+  Run *run = 0;
+
+  void Ran(Redline::Editor &editor, long long sent)
+  {
+    run->latencies.push_back(Microseconds() - sent);
+    if (++run->ran == run->producers * run->perProducer && editor.GetMode())
+    {
+      editor.EndMode();
+    }
+  }
+
+  void Send(const Redline::Command *command)
+  {
+    if (run->editor)
+    {
+      run->editor->AsyncCommand(command);
+      return;
+    }
+    run->fifo->Push(command);
+    const char wake = 0;
+    while (write(run->wakeFd[1], &wake, 1) < 1 && errno == EINTR) {}
+  }
+
+  void *Produce(void *)
+  {
+    for (int n = 0; n < run->perProducer; ++n)
+    {
+      Send(new Redline::Command("", boost::bind(&Ran, _1, Microseconds())));
+    }
+    return 0;
+  }
+
+  //! Stands in for the editor with the old queue: wait for the pipe, then run what's queued.
+  void *TakeFromFifo(void *)
+  {
+    Redline::Editor idle;
+    const long total = static_cast<long>(run->producers) * run->perProducer;
+    while (run->ran < total)
+    {
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(run->wakeFd[0], &fds);
+      if (select(run->wakeFd[0] + 1, &fds, 0, 0, 0) <= 0)
+      {
+        continue;
+      }
+      char drain[64];
+      read(run->wakeFd[0], drain, sizeof(drain));
+      const Redline::Command *command = 0;
+      while (run->fifo->Pop(command))
+      {
+        command->Run(idle, Redline::KeyCombination());
+        delete command;
+      }
+    }
+    return 0;
+  }
+
+  int ptyMaster = -1, ptySlave = -1;
+
+  void *RunEditor(void *)
+  {
+    run->editor->Run(ptySlave, ptySlave, "xterm");
+    return 0;
+  }
+
+  //! Read what the editor draws, so that it never blocks writing it.
+  void *DrainPty(void *)
+  {
+    char buffer[65536];
+    while (read(ptyMaster, buffer, sizeof(buffer)) > 0) {}
+    return 0;
+  }
+
+  void Report(const char *name, const Run &r, long long started, long long pushed,
+              long long finished)
+  {
+    std::vector<long long> sorted(r.latencies);
+    std::sort(sorted.begin(), sorted.end());
+    const size_t count = sorted.size();
+    const long total = static_cast<long>(r.producers) * r.perProducer;
+    printf("%-12s %6.2f M pushes/s, all run after %7.1f ms; latency us p50 %lld p99 %lld max %lld\n",
+           name, total / double(pushed - started), (finished - started) / 1000.0,
+           count ? sorted[count / 2] : 0, count ? sorted[count * 99 / 100] : 0,
+           count ? sorted.back() : 0);
+  }
+
+  void Measure(const char *name, Run &r, void *(*take)(void *))
+  {
+    run = &r;
+    pthread_t taker;
+    pthread_create(&taker, 0, take, 0);
+    // Let the taker settle into waiting.
+    usleep(300000);
+
+    std::vector<pthread_t> producers(r.producers);
+    const long long started = Microseconds();
+    for (int n = 0; n < r.producers; ++n)
+    {
+      pthread_create(&producers[n], 0, &Produce, 0);
+    }
+    for (int n = 0; n < r.producers; ++n)
+    {
+      pthread_join(producers[n], 0);
+    }
+    const long long pushed = Microseconds();
+    pthread_join(taker, 0);
+    Report(name, r, started, pushed, Microseconds());
+    run = 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const int producers = argc > 1 ? std::max(1, atoi(argv[1])) : 4;
+  const int perProducer = argc > 2 ? std::max(1, atoi(argv[2])) : 200000;
+  printf("%d producers, %d commands each\n", producers, perProducer);
+
+  {
+    Run r(producers, perProducer);
+    LockedFifo<const Redline::Command *> fifo;
+    r.fifo = &fifo;
+    pipe(r.wakeFd);
+    Measure("LockedFifo", r, &TakeFromFifo);
+    close(r.wakeFd[0]);
+    close(r.wakeFd[1]);
+  }
+
+  {
+    const char *slaveName = 0;
+    ptyMaster = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ptyMaster < 0 || grantpt(ptyMaster) != 0 || unlockpt(ptyMaster) != 0 ||
+        !(slaveName = ptsname(ptyMaster)) || (ptySlave = open(slaveName, O_RDWR | O_NOCTTY)) < 0)
+    {
+      perror("pty");
+      return 1;
+    }
+    pthread_t drainer;
+    pthread_create(&drainer, 0, &DrainPty, 0);
+    Run r(producers, perProducer);
+    Redline::Editor editor;
+    // The last command ends the mode, which deletes it.
+    new Redline::EmacsMode(editor);
+    r.editor = &editor;
+    Measure("AsyncCommand", r, &RunEditor);
+  }
+  // The pty drainer is still blocked reading.
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,89 @@
+//--------------------------------------------------------------------------------------------------
+/*! Throughput of mapping terminal input to keys: a random stream of escape sequences, fragments of
+ *  them and plain characters is fed to an embedded terminal a read at a time, and every key taken
+ *  out, so that the time covers the input buffer and the key queue as well as the key map.
+ *
+ *  Usage: bench-keymap [megabytes [term type [seed]]], by default 64MB as xterm.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "redline/terminal.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <sys/time.h>
+
+namespace
+{
+  //! What a keyboard sends, and some of what a slow or broken link makes of it. No bracketed paste:
+  //! its start would take the rest of the stream as pasted text.
+  const char *const Fragments[] =
+  {
+    "\x1b[A", "\x1bOA", "\x1b[1;5C", "\x1b[5~", "\x1b[15;3~", "\x1bOj", "\x1b[", "\x1b[1;", "\x1bO",
+    "\x1b", "a", "b", "x", "[", "~", "\x7f", "\x04"
+  };
+
+  //! Size of a read of the terminal.
+  const size_t ReadSize = 4096;
+
+  long long Microseconds()
+  {
+    timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1000000LL + now.tv_usec;
+  }
+
+  void Discard(const char *, size_t) {}
+
+  //! Take the keys mapped so far, adding them to \p sum.
+  size_t TakeKeys(Redline::Terminal &terminal, unsigned long &sum)
+  {
+    size_t keys = 0;
+    for (; terminal.HaveKey(); ++keys)
+    {
+      sum = sum * 31 + terminal.GetKey();
+    }
+    return keys;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const size_t megabytes = argc > 1 ? std::max(1, atoi(argv[1])) : 64;
+  const std::string termType = argc > 2 ? argv[2] : "xterm";
+  srand(argc > 3 ? atoi(argv[3]) : 1);
+
+  // A few MB of input, fed over and over.
+  std::string input;
+  while (input.size() < (4 << 20))
+  {
+    input += Fragments[rand() % (sizeof(Fragments) / sizeof(*Fragments))];
+  }
+
+  Redline::Terminal terminal(termType, 24, 80, &Discard);
+  const size_t total = megabytes << 20;
+  size_t fed = 0, keys = 0;
+  unsigned long sum = 0;
+  const long long started = Microseconds();
+  while (fed < total)
+  {
+    for (size_t at = 0; at < input.size() && fed < total; at += ReadSize)
+    {
+      const size_t size = std::min(ReadSize, input.size() - at);
+      terminal.Feed(input.data() + at, size);
+      fed += size;
+      keys += TakeKeys(terminal, sum);
+    }
+  }
+  // Whatever is left is a partial escape sequence.
+  terminal.TimeOutInput();
+  keys += TakeKeys(terminal, sum);
+  const double seconds = (Microseconds() - started) / 1e6;
+
+  printf("%s: %zu MB, %zu keys in %.2f s: %.1f MB/s, %.1f M keys/s (checksum %lx)\n",
+         termType.c_str(), fed >> 20, keys, seconds, fed / seconds / 1e6, keys / seconds / 1e6,
+         sum);
+  return 0;
+}
@@ -0,0 +1,155 @@
+//--------------------------------------------------------------------------------------------------
+/*! Keystroke latency of a Reactor serving many sessions: each session is one end of a socketpair,
+ *  and a keystroke is timed from writing it to the other end to the redrawn line coming back.
+ *
+ *  Usage: bench-reactor [sessions [threads [rounds]]], by default 10000 sessions, a worker per CPU
+ *  and 5 rounds over a sample of up to 1000 of the sessions.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "redline/editor.hpp"
+#include "redline/emacs.hpp"
+#include "redline/reactor.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace
+{
+  //! Fds needed besides the sessions': stdio, and each worker's pipe and epoll.
+  const int SpareFds = 64;
+
+  void StartSession(Redline::Editor &editor)
+  {
+    new Redline::EmacsMode(editor);
+  }
+
+  double Microseconds()
+  {
+    timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1e6 + now.tv_usec;
+  }
+
+  //! Read what's waiting, without blocking.
+  size_t Drain(int fd)
+  {
+    char buffer[65536];
+    size_t total = 0;
+    for (ssize_t n; (n = read(fd, buffer, sizeof(buffer))) > 0; /**/)
+    {
+      total += n;
+    }
+    return total;
+  }
+
+  //! Wait up to \p timeoutMs for output on \p fd.
+  bool WaitForOutput(int fd, int timeoutMs)
+  {
+    pollfd ready = { fd, POLLIN, 0 };
+    return poll(&ready, 1, timeoutMs) == 1;
+  }
+
+  double Percentile(const std::vector<double> &sorted, int percent)
+  {
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+  }
+
+  //! Allow as many fds as we may, and say how many sessions fit.
+  int FitSessions(int sessions)
+  {
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    const int fit = std::max<long>(1, (static_cast<long>(limit.rlim_cur) - SpareFds) / 2);
+    if (fit < sessions)
+    {
+      printf("only %d sessions fit in the fd limit of %ld\n", fit,
+             static_cast<long>(limit.rlim_cur));
+      return fit;
+    }
+    return sessions;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const int sessions = FitSessions(argc > 1 ? atoi(argv[1]) : 10000);
+  const int threads = argc > 2 ? atoi(argv[2]) : 0;
+  const int rounds = argc > 3 ? atoi(argv[3]) : 5;
+
+  std::vector<int> fds;
+  Redline::Reactor reactor(threads);
+  const double starting = Microseconds();
+  for (int n = 0; n < sessions; ++n)
+  {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) != 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+    fds.push_back(pair[0]);
+    reactor.AddSession(pair[1], "xterm", 24, 80, &StartSession);
+  }
+
+  // Each session draws its prompt when it starts.
+  size_t startupBytes = 0;
+  for (int n = 0; n < sessions; ++n)
+  {
+    if (!WaitForOutput(fds[n], 10000))
+    {
+      printf("session %d didn't start\n", n);
+      return 1;
+    }
+    startupBytes += Drain(fds[n]);
+  }
+  printf("%d sessions on %d workers started in %.1f ms, %zu bytes\n", sessions,
+         reactor.GetNumWorkers(), (Microseconds() - starting) / 1000, startupBytes);
+  for (int w = 0; w < reactor.GetNumWorkers(); ++w)
+  {
+    const Redline::Reactor::WorkerStats stats = reactor.GetWorkerStats(w);
+    printf("  worker %d: %zu sessions, %zu stolen\n", w, stats.sessions, stats.stolen);
+  }
+
+  std::vector<double> latencies;
+  size_t outputBytes = 0;
+  const int step = std::max(1, sessions / 1000);
+  for (int round = 0; round < rounds; ++round)
+  {
+    for (int n = 0; n < sessions; n += step)
+    {
+      const double written = Microseconds();
+      if (write(fds[n], "x", 1) != 1 || !WaitForOutput(fds[n], 2000))
+      {
+        printf("no echo from session %d\n", n);
+        continue;
+      }
+      latencies.push_back(Microseconds() - written);
+      outputBytes += Drain(fds[n]);
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("%zu keystrokes, %.1f bytes each: latency us p50 %.0f p90 %.0f p99 %.0f max %.0f\n",
+         latencies.size(), latencies.empty() ? 0.0 : double(outputBytes) / latencies.size(),
+         Percentile(latencies, 50), Percentile(latencies, 90), Percentile(latencies, 99),
+         latencies.empty() ? 0.0 : latencies.back());
+
+  const double stopping = Microseconds();
+  reactor.Stop();
+  printf("stopped in %.1f ms\n", (Microseconds() - stopping) / 1000);
+  for (int n = 0; n < sessions; ++n)
+  {
+    close(fds[n]);
+  }
+  return 0;
+}
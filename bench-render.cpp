@@ -0,0 +1,382 @@
+//--------------------------------------------------------------------------------------------------
+/*! Renders editing scenarios through an embedded editor into a VirtualTerminal, checks what ends up
+ *  on the screen, and reports what each frame cost: the bytes and sequences the terminal had to
+ *  interpret, and the time taken to produce and to interpret them.
+ *
+ *  Random frames in random attributes are also drawn on several types of terminal, checking that
+ *  every cell ends up with the frame's character in the frame's attribute.
+ *
+ *  Usage: bench-render [iterations], by default 200 of each scenario. Exits with 1 if a screen
+ *  isn't as expected.
+ */
+//--------------------------------------------------------------------------------------------------
+#include "redline/editor.hpp"
+#include "redline/emacs.hpp"
+#include "redline/terminal.hpp"
+#include "redline/virtual-terminal.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include <sys/time.h>
+
+namespace
+{
+  const int Rows = 24, Columns = 80;
+
+  long long Microseconds()
+  {
+    timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1000000LL + now.tv_usec;
+  }
+
+  //! A step of a scenario: input, or a change of size if there's none. Each step is one frame.
+  struct Step
+  {
+    Step(const std::string &_input, int _rows = 0, int _columns = 0) :
+      input(_input), rows(_rows), columns(_columns) {}
+    std::string input;
+    int rows, columns;
+  };
+
+  struct Scenario
+  {
+    Scenario() : name(), rows(Rows), columns(Columns), cursorRow(), cursorColumn() {}
+    const char *name;
+    //! The size of the screen to start with.
+    int rows, columns;
+    std::vector<Step> steps;
+    //! The screen expected at the end, and the cursor.
+    std::string screen;
+    int cursorRow, cursorColumn;
+  };
+
+  //! Frame costs summed over a scenario's runs.
+  struct Totals
+  {
+    Totals() : frames(), bytes(), sequences(), unknownSequences(), editorUsec(), renderUsec(),
+               terminalUsec() {}
+    size_t frames;
+    size_t bytes;
+    size_t sequences;
+    size_t unknownSequences;
+    //! Handling the input, laying out and diffing the frame, all told.
+    long long editorUsec;
+    //! Laying out and diffing, from the terminal's frame statistics.
+    long long renderUsec;
+    //! Interpreting the frame.
+    long long terminalUsec;
+  };
+
+  //! Type \p text a key at a time.
+  void Type(Scenario &scenario, const std::string &text)
+  {
+    for (size_t n = 0; n < text.size(); ++n)
+    {
+      scenario.steps.push_back(Step(text.substr(n, 1)));
+    }
+  }
+
+  //! Send \p keys at once.
+  void Press(Scenario &scenario, const std::string &keys)
+  {
+    scenario.steps.push_back(Step(keys));
+  }
+
+  void Resize(Scenario &scenario, int rows, int columns)
+  {
+    scenario.steps.push_back(Step(std::string(), rows, columns));
+  }
+
+  std::vector<Scenario> MakeScenarios()
+  {
+    std::vector<Scenario> scenarios(6);
+
+    Scenario *s = &scenarios[0];
+    s->name = "typing";
+    Type(*s, "the quick brown fox jumps over the lazy dog");
+    s->screen = "$ the quick brown fox jumps over the lazy dog";
+    s->cursorRow = 0;
+    s->cursorColumn = 45;
+
+    s = &scenarios[1];
+    s->name = "mid-line edits";
+    Type(*s, "the quick brown fox");
+    Press(*s, "\x01");
+    Press(*s, "\x06\x06\x06\x06");
+    Type(*s, "very ");
+    Press(*s, "\x05");
+    Press(*s, "\x02\x02\x02");
+    Press(*s, "\x04\x04\x04");
+    Type(*s, "cat");
+    Press(*s, "\x7f");
+    Type(*s, "t");
+    s->screen = "$ the very quick brown cat";
+    s->cursorRow = 0;
+    s->cursorColumn = 26;
+
+    // With the prompt, 200 characters wrap over three rows of 80, each but the last ending in a
+    // backslash.
+    s = &scenarios[2];
+    s->name = "wrapping";
+    Type(*s, std::string(198, 'a'));
+    Press(*s, "\x01");
+    Type(*s, "bb");
+    s->screen = "$ bb" + std::string(75, 'a') + "\\\n" + std::string(79, 'a') + "\\\n" +
+                std::string(44, 'a');
+    s->cursorRow = 0;
+    s->cursorColumn = 4;
+
+    s = &scenarios[3];
+    s->name = "delete to end";
+    Type(*s, "one two three");
+    Press(*s, "\x01\x06\x06\x06\x06");
+    Press(*s, "\x0b");
+    Type(*s, "four");
+    s->screen = "$ one four";
+    s->cursorRow = 0;
+    s->cursorColumn = 10;
+
+    s = &scenarios[4];
+    s->name = "resize";
+    Type(*s, std::string(60, 'c'));
+    Resize(*s, Rows, 40);
+    Resize(*s, Rows, 20);
+    Resize(*s, Rows, Columns);
+    s->screen = "$ " + std::string(60, 'c');
+    s->cursorRow = 0;
+    s->cursorColumn = 62;
+
+    // A pasted screenful of text on a big terminal, then typing at the end of it: each frame
+    // changes one cell of 30000.
+    s = &scenarios[5];
+    s->name = "300x100 typing";
+    s->rows = 100;
+    s->columns = 300;
+    std::string paste, row(290, 'd');
+    for (int n = 0; n < 98; ++n)
+    {
+      paste += row + "\n";
+      s->screen += (n ? "> " : "$ ") + row + "\n";
+    }
+    Press(*s, "\x1b[200~" + paste + "\x1b[201~");
+    Type(*s, std::string(20, 'e'));
+    s->screen += "> " + std::string(20, 'e');
+    s->cursorRow = 98;
+    s->cursorColumn = 22;
+
+    return scenarios;
+  }
+
+  //! Run \p scenario once, adding to \p totals.
+  /*! \return \c false if the screen didn't end up as expected.
+   */
+  bool Run(const Scenario &scenario, Totals &totals)
+  {
+    Redline::Editor editor;
+    Redline::EmacsMode mode(editor);
+    Redline::VirtualTerminal screen(scenario.rows, scenario.columns);
+    std::string output;
+    editor.Open("xterm", scenario.rows, scenario.columns);
+    if (editor.TakeOutput(output))
+    {
+      screen.Feed(output);
+    }
+    screen.ResetStats();
+
+    for (size_t n = 0; n < scenario.steps.size(); ++n)
+    {
+      const Step &step = scenario.steps[n];
+      const long long started = Microseconds();
+      if (!step.input.empty())
+      {
+        editor.Feed(step.input.data(), step.input.size());
+      }
+      else
+      {
+        screen.Resize(step.rows, step.columns);
+        editor.Resize(step.rows, step.columns);
+      }
+      const bool drawn = editor.TakeOutput(output);
+      totals.editorUsec += Microseconds() - started;
+      if (drawn)
+      {
+        screen.Feed(output);
+        const Redline::Terminal::FrameStats &frame = editor.GetTerminal()->GetFrameStats();
+        totals.renderUsec += frame.layoutUsec + frame.diffUsec;
+      }
+      ++totals.frames;
+    }
+
+    const Redline::VirtualTerminal::Stats &stats = screen.GetStats();
+    totals.bytes += stats.bytes;
+    totals.sequences += stats.sequences;
+    totals.unknownSequences += stats.unknownSequences;
+    totals.terminalUsec += stats.usec;
+
+    if (screen.GetScreen() != scenario.screen || screen.GetCursorRow() != scenario.cursorRow ||
+        screen.GetCursorColumn() != scenario.cursorColumn)
+    {
+      printf("%s: expected cursor at %d,%d and\n%s\ngot cursor at %d,%d and\n%s\n", scenario.name,
+             scenario.cursorRow, scenario.cursorColumn, scenario.screen.c_str(),
+             screen.GetCursorRow(), screen.GetCursorColumn(), screen.GetScreen().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  //! Term types to draw random frames on, which have various ways to move.
+  const char *const AttributeTermTypes[] = { "xterm", "screen", "rxvt", "linux" };
+
+  //! One of a few attributes, so that changed cells are often next to cells in the same one.
+  Redline::TerminalAttribute RandomAttribute()
+  {
+    using Redline::TerminalAttribute;
+    switch (rand() % 4)
+    {
+    case 0: return TerminalAttribute(TerminalAttribute::Bold, TerminalAttribute::Red);
+    case 1: return TerminalAttribute(TerminalAttribute::Underline | TerminalAttribute::Reverse,
+                                     TerminalAttribute::Default, TerminalAttribute::Blue);
+    default: return TerminalAttribute();
+    }
+  }
+
+  void Append(std::string *output, const char *data, size_t size)
+  {
+    output->append(data, size);
+  }
+
+  //! Draw \p frames random frames on \p termType, each a small change to the last.
+  /*! \return \c false if a cell didn't end up as drawn.
+   */
+  bool DrawRandomAttributes(const char *termType, int frames)
+  {
+    using Redline::TerminalAttribute;
+    const int rows = 8, columns = 40;
+    std::string output;
+    Redline::Terminal terminal(termType, rows, columns, boost::bind(&Append, &output, _1, _2));
+    Redline::VirtualTerminal screen(rows, columns);
+
+    // Each row is a few runs of a few characters, short enough not to wrap.
+    std::vector<std::string> chars(rows - 2);
+    std::vector<std::vector<TerminalAttribute> > attributes(chars.size());
+    for (int frame = 0; frame < frames; ++frame)
+    {
+      // Mostly characters changed in place, which leave the attribute they were drawn in current
+      // when the cursor moves on, sometimes characters inserted or deleted.
+      for (int changes = rand() % 4 + 1; changes; --changes)
+      {
+        const size_t row = rand() % chars.size();
+        std::string &rowChars = chars[row];
+        std::vector<TerminalAttribute> &rowAttributes = attributes[row];
+        const size_t at = rowChars.empty() ? 0 : rand() % rowChars.size();
+        const size_t length = rand() % 5 + 1;
+        const TerminalAttribute attribute = RandomAttribute();
+        const char ch = 'a' + rand() % 3;
+        const int kind = rand() % 8;
+        if (kind < 5 && !rowChars.empty())
+        {
+          const size_t end = std::min(at + length, rowChars.size());
+          rowChars.replace(at, end - at, end - at, ch);
+          std::fill(rowAttributes.begin() + at, rowAttributes.begin() + end, attribute);
+        }
+        else if (kind < 7)
+        {
+          const size_t room = std::min<size_t>(length, columns - 1 - rowChars.size());
+          rowChars.insert(at, room, ch);
+          rowAttributes.insert(rowAttributes.begin() + at, room, attribute);
+        }
+        else
+        {
+          const size_t end = std::min(at + length, rowChars.size());
+          rowChars.erase(at, end - at);
+          rowAttributes.erase(rowAttributes.begin() + at, rowAttributes.begin() + end);
+        }
+      }
+
+      Redline::DecoratedText text;
+      for (size_t row = 0; row < chars.size(); ++row)
+      {
+        for (size_t col = 0; col < chars[row].size(); ++col)
+        {
+          text.Add(attributes[row][col], chars[row].substr(col, 1));
+        }
+        if (row + 1 < chars.size())
+        {
+          text.Add(TerminalAttribute(), "\n");
+        }
+      }
+      const int cursorRow = rand() % chars.size();
+      terminal.SetText(text, cursorRow, rand() % (chars[cursorRow].size() + 1));
+      screen.Feed(output);
+      output.clear();
+
+      for (int row = 0; row < static_cast<int>(chars.size()); ++row)
+      {
+        const std::string shownRow = screen.GetRow(row);
+        for (int col = 0; col < columns; ++col)
+        {
+          const bool drawn = col < static_cast<int>(chars[row].size());
+          const char expected = drawn ? chars[row][col] : ' ';
+          const TerminalAttribute &attribute = drawn ? attributes[row][col] : TerminalAttribute();
+          const char shown = col < static_cast<int>(shownRow.size()) ? shownRow[col] : ' ';
+          if (shown != expected || (drawn && screen.GetAttribute(row, col) != attribute))
+          {
+            printf("%s: frame %d, row %d column %d isn't '%c' in style %d, colours %d on %d\n",
+                   termType, frame, row, col, expected, attribute.style, attribute.foreground,
+                   attribute.background);
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const int iterations = argc > 1 ? std::max(1, atoi(argv[1])) : 200;
+  const std::vector<Scenario> scenarios = MakeScenarios();
+
+  printf("%-16s %7s %9s %9s %9s %9s %9s\n", "per frame", "frames", "bytes", "sequences",
+         "editor us", "render us", "vt us");
+  bool ok = true;
+  for (size_t n = 0; n < scenarios.size(); ++n)
+  {
+    Totals totals;
+    for (int i = 0; i < iterations && ok; ++i)
+    {
+      ok = Run(scenarios[n], totals);
+    }
+    if (!ok)
+    {
+      break;
+    }
+    const double frames = totals.frames;
+    printf("%-16s %7zu %9.1f %9.1f %9.2f %9.2f %9.2f\n", scenarios[n].name,
+           totals.frames / iterations, totals.bytes / frames, totals.sequences / frames,
+           totals.editorUsec / frames, totals.renderUsec / frames, totals.terminalUsec / frames);
+    if (totals.unknownSequences)
+    {
+      printf("  %zu sequences not understood\n", totals.unknownSequences);
+    }
+  }
+
+  for (size_t n = 0; n < sizeof(AttributeTermTypes) / sizeof(*AttributeTermTypes) && ok; ++n)
+  {
+    srand(n + 1);
+    ok = DrawRandomAttributes(AttributeTermTypes[n], iterations * 10);
+  }
+  if (ok)
+  {
+    printf("random attributes drawn correctly\n");
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+//--------------------------------------------------------------------------------------------------
+/*! Records a session on the terminal, or replays a recording into an editor and reports what each
+ *  event, usually a keypress, cost: the editor's time and the bytes it wrote.
+ *
+ *  Usage: bench-replay record <file>   edit on this terminal until ^D, then save the recording
+ *         bench-replay [-realtime] <file>   replay, as fast as possible unless -realtime
+ */
+//--------------------------------------------------------------------------------------------------
+#include "redline/editor.hpp"
+#include "redline/emacs.hpp"
+#include "redline/recording.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace
+{
+  //! \p data, with control characters shown as ^X, cut short with "..." if longer than \p max.
+  std::string Describe(const std::string &data, size_t max)
+  {
+    std::string result;
+    for (size_t n = 0; n < data.size(); ++n)
+    {
+      const unsigned char c = data[n];
+      if (c < 0x20 || c == 0x7f)
+      {
+        result += '^';
+        result += static_cast<char>(c ^ 0x40);
+      }
+      else
+      {
+        result += static_cast<char>(c);
+      }
+    }
+    return result.size() > max ? result.substr(0, max - 3) + "..." : result;
+  }
+
+  int Record(const char *path)
+  {
+    Redline::Recording recording;
+    {
+      Redline::Editor editor;
+      new Redline::EmacsMode(editor);
+      editor.SetRecording(&recording);
+      editor.Run();
+    }
+    std::ofstream out(path, std::ios::binary);
+    recording.Write(out);
+    if (!out)
+    {
+      perror(path);
+      return 1;
+    }
+    printf("%zu events over %.1f s saved to %s\n", recording.GetNumEvents(),
+           recording.GetDuration() / 1e6, path);
+    return 0;
+  }
+
+  int Replay(const char *path, Redline::Recording::Speed speed)
+  {
+    std::ifstream in(path, std::ios::binary);
+    Redline::Recording recording;
+    if (!recording.Read(in))
+    {
+      fprintf(stderr, "%s: not a recording\n", path);
+      return 1;
+    }
+
+    Redline::Editor editor;
+    new Redline::EmacsMode(editor);
+    Redline::Recording::ReplayStats stats;
+    recording.Replay(editor, speed, stats);
+
+    const Redline::Terminal::ControlCharacters &keys = recording.GetControlCharacters();
+    printf("%s, %dx%d, escape timeout %d ms, eof/susp/intr/quit %d/%d/%d/%d, sync output %s\n",
+           recording.GetTermType().c_str(), recording.GetNumRows(), recording.GetNumColumns(),
+           recording.GetEscapeTimeout(), keys.eof, keys.susp, keys.intr, keys.quit,
+           recording.GetSyncOutput() ? "on" : "off");
+    printf("%6s  %-20s %8s %8s\n", "event", "input", "usec", "bytes");
+    for (size_t n = 0; n < stats.events; ++n)
+    {
+      const std::string &data = recording.GetEventInput(n);
+      const std::string input = data.empty() ? "(resize)" : Describe(data, 20);
+      printf("%6zu  %-20s %8ld %8zu\n", n, input.c_str(), stats.eventUsec[n],
+             stats.eventOutputBytes[n]);
+    }
+    printf("%zu events, %zu bytes in, %zu bytes out, %ld usec, %s\n", stats.events,
+           stats.inputBytes, stats.outputBytes, stats.usec,
+           editor.IsOpen() ? "still open" : "mode ended");
+    return 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc == 3 && strcmp(argv[1], "record") == 0)
+  {
+    return Record(argv[2]);
+  }
+  if (argc == 3 && strcmp(argv[1], "-realtime") == 0)
+  {
+    return Replay(argv[2], Redline::Recording::RealTime);
+  }
+  if (argc == 2)
+  {
+    return Replay(argv[1], Redline::Recording::AsFastAsPossible);
+  }
+  fprintf(stderr, "usage: %s record <file> | [-realtime] <file>\n", argv[0]);
+  return 2;
+}
@@ -37,7 +37,10 @@ namespace Redline
       Home,
       End,
       Insert,
-      Delete
+      Delete,
+
+      Resize,      // Not a key: the terminal has changed size
+      Paste        // Not a key: text was pasted; see Terminal::GetPaste()
     };
   }
 
@@ -1,66 +1,195 @@
 #include "redline/editor.hpp"
 
+#include <algorithm>
 #include <iostream>
-#include <deque>
+#include <sstream>
+
 #include <pthread.h>
+#include <sys/time.h>
+
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
 
 #include "redline/bindings.hpp"
 #include "redline/command.hpp"
+#include "redline/event-loop.hpp"
 #include "redline/terminal.hpp"
 #include "redline/mode.hpp"
 
 using namespace Redline;
 
+//--------------------------------------------------------------------------------------------------
+/*! A lock-free queue, with any number of threads pushing and one taking. Pushing puts an item on a
+ *  stack with compare-and-swap; taking swaps the whole stack for an empty one, and reverses it into
+ *  the order it was pushed in. As only whole stacks are taken, the ABA problem can't arise.
+ *
+ *  The queue itself is unbounded; it counts what's in it, so that its users can bound it.
+ */
+//--------------------------------------------------------------------------------------------------
 template<typename T>
-class LockedFifo
+class AsyncQueue : boost::noncopyable
 {
 public:
-  LockedFifo()
+  AsyncQueue() : head(), size() {}
+  ~AsyncQueue()
   {
-    pthread_mutex_init(&mutex, 0);
+    Node *node = 0;
+    while (Take(node))
+    {
+      Free(node);
+    }
   }
-  ~LockedFifo()
+
+  bool Empty() const { return !head; }
+  //! How many items are queued. Only approximate while items are being pushed or taken.
+  long Size() const { return size; }
+
+  //! Add \p t to the queue. Any thread.
+  /*! \return \c true if the queue was empty, so that the taker may need waking.
+   */
+  bool Push(const T &t)
   {
-    pthread_mutex_destroy(&mutex);
+    Node *node = new Node(t);
+    Node *old = 0;
+    do
+    {
+      old = head;
+      node->next = old;
+    } while (!__sync_bool_compare_and_swap(&head, old, node));
+    __sync_add_and_fetch(&size, 1);
+    return !old;
   }
-  void Push(T t) throw()
+
+  //! Take everything in the queue, oldest first, calling \p f on each. The taker's thread only.
+  /*! \return \c false if the queue was empty.
+   */
+  template<typename F>
+  bool Drain(F f)
   {
-    pthread_mutex_lock(&mutex);
-    fifo.push_back(t);
-    pthread_mutex_unlock(&mutex);
+    Node *node = 0;
+    if (!Take(node))
+    {
+      return false;
+    }
+    for (Node *next; node; node = next)
+    {
+      next = node->next;
+      f(node->value);
+      delete node;
+    }
+    return true;
   }
-  bool Pop(T &t) throw()
+
+private:
+  struct Node
+  {
+    Node(const T &_value) : value(_value), next() {}
+    T value;
+    Node *next;
+  };
+
+  //! Empty the queue, setting \p list to what was in it, oldest first.
+  bool Take(Node *&list)
   {
-    pthread_mutex_lock(&mutex);
-    bool result = false;
-    if (!fifo.empty())
+    // Cheap enough to check on every key.
+    if (!head)
     {
-      t = fifo.front();
-      fifo.pop_front();
-      result = true;
+      return false;
     }
-    pthread_mutex_unlock(&mutex);
-    return result;
+    Node *taken = 0;
+    do
+    {
+      taken = head;
+    } while (!__sync_bool_compare_and_swap(&head, taken, static_cast<Node *>(0)));
+
+    list = 0;
+    long count = 0;
+    for (/**/; taken; ++count)
+    {
+      Node *next = taken->next;
+      taken->next = list;
+      list = taken;
+      taken = next;
+    }
+    __sync_sub_and_fetch(&size, count);
+    return true;
   }
-private:
-  pthread_mutex_t mutex;
-  std::deque<T> fifo;
+
+  static void Free(Node *list)
+  {
+    for (Node *next; list; list = next)
+    {
+      next = list->next;
+      delete list;
+    }
+  }
+
+  Node *volatile head;
+  volatile long size;
 };
 
 class Editor::Internals
 {
 public:
-  Internals(Editor &_editor) : editor(_editor), terminal(), mode()
+  Internals(Editor &_editor) : editor(_editor), terminal(), mode(), recording(), output(),
+    asyncCommands(), running(), runThread(), waitingToSend(), printQueue(), printDropped(),
+    printed()
+  {
+    pthread_mutex_init(&sendMutex, 0);
+    pthread_cond_init(&sent, 0);
+    lastPrinted.tv_sec = lastPrinted.tv_usec = 0;
+  }
+  ~Internals()
   {
+    pthread_cond_destroy(&sent);
+    pthread_mutex_destroy(&sendMutex);
   }
 
-  void Run(bool noTerminal);
+  void Run(Terminal *terminal);
+  void HandleKey(Key key);
+  void RunAsyncCommand(const Command *command);
+  void RunAsyncCommands();
+
+  void Write(const char *data, size_t size) { output.append(data, size); }
 
   Editor &editor;
   Terminal *terminal;
   Mode *mode;
+  EventLoop eventLoop;
+  Recording *recording;
+
+  //! Output for an embedded terminal, waiting for TakeOutput().
+  std::string output;
+
+  AsyncQueue<const Command*> asyncCommands;
+
+  //! Back-pressure on AsyncCommand(): while Run() is editing on \c runThread, other threads wait
+  //! for it to catch up once MaxAsyncCommands are queued.
+  //@{
+  static const long MaxAsyncCommands = 4096;
+  volatile bool running;
+  pthread_t runThread;
+  volatile long waitingToSend;
+  pthread_mutex_t sendMutex;
+  pthread_cond_t sent;
+  void WaitToSend();
+  void WakeSenders();
+  //@}
 
-  LockedFifo<const Command*> asyncCommands;
+  //! Text for PrintAbove(), printed in batches, at most one every PrintIntervalMs. Past
+  //! MaxQueuedPrints, text is dropped, and the number dropped printed instead.
+  //@{
+  static const long PrintIntervalMs = 20;
+  static const long MaxQueuedPrints = 4096;
+  AsyncQueue<std::string> printQueue;
+  volatile long printDropped;
+  timeval lastPrinted;
+  //! The batch being printed.
+  std::string printed;
+  void AddPrinted(const std::string &text);
+  void PrintQueued();
+  int GetPrintTimeout() const;
+  //@}
 };
 
 Editor::Editor() :
@@ -70,17 +199,32 @@ Editor::Editor() :
 
 Editor::~Editor()
 {
+  delete internals->terminal;
   delete internals;
 }
 
-void Editor::Internals::Run(bool noTerminal)
+//--------------------------------------------------------------------------------------------------
+/*! Edit until the mode ends, on \p _terminal, which is deleted afterwards, or on stdin without a
+ *  terminal if it's 0.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Internals::Run(Terminal *_terminal)
 {
   //Assert(!terminal, "Recursive invocation of Redline::Editor::Run?");
 
-  if (!noTerminal)
+  terminal = _terminal;
+  if (terminal)
   {
-    terminal = new Terminal;
+    terminal->SetEventLoop(&eventLoop);
+    if (recording)
+    {
+      terminal->SetRecording(recording);
+    }
   }
+  runThread = pthread_self();
+  running = terminal != 0;
+  // Commands sent before there was a terminal to wake.
+  RunAsyncCommands();
 
   while (mode)
   {
@@ -91,9 +235,10 @@ void Editor::Internals::Run(bool noTerminal)
 
       // Update screen.
       mode->Render(*terminal);
+      PrintQueued();
 
-      // Block waiting for next key.
-      terminal->WaitForKey();
+      // Block waiting for next key, or until more can be printed.
+      terminal->WaitForKey(GetPrintTimeout());
     }
 
     do
@@ -102,44 +247,315 @@ void Editor::Internals::Run(bool noTerminal)
       // Convert EOF from getchar() to Keys::Eof, but leave all
       // other characters intact.
       key = (!terminal && key == EOF) ? Keys::Eof : key;
-      KeyCombination keys(key);
-      if (const Command *command = mode->GetHandler(keys))
-      {
-        command->Run(editor, keys);
-      }
-      else if (terminal && key != Keys::AsyncInterrupted)
-      {
-        terminal->Bell();
-      }
-
-      // Process async commands.
-      const Command *command = 0;
-      while (asyncCommands.Pop(command))
-      {
-        command->Run(editor, KeyCombination());
-        delete command;
-      }
-    } while (terminal && terminal->HaveKey());
+      HandleKey(key);
+    } while (mode && terminal && terminal->HaveKey());
   }
 
+  running = false;
+  WakeSenders();
   delete terminal;
   terminal = 0;
 }
 
+void Editor::Internals::HandleKey(Key key)
+{
+  KeyCombination keys(key);
+  if (const Command *command = mode->GetHandler(keys))
+  {
+    command->Run(editor, keys);
+  }
+  else if (terminal && key != Keys::AsyncInterrupted && key != Keys::Resize)
+  {
+    terminal->Bell();
+  }
+
+  RunAsyncCommands();
+}
+
+void Editor::Internals::RunAsyncCommand(const Command *command)
+{
+  command->Run(editor, KeyCombination());
+  delete command;
+}
+
+void Editor::Internals::RunAsyncCommands()
+{
+  // Commands may send more.
+  while (asyncCommands.Drain(boost::bind(&Internals::RunAsyncCommand, this, _1)))
+  {
+    WakeSenders();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Wait until the editor has taken the queued commands, if there are too many of them. Only while
+ *  Run() is editing, and never on its own thread: without a thread waiting for keys, nothing would
+ *  take them.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Internals::WaitToSend()
+{
+  if (asyncCommands.Size() < MaxAsyncCommands || !running || pthread_equal(runThread, pthread_self()))
+  {
+    return;
+  }
+  pthread_mutex_lock(&sendMutex);
+  // Counted before looking at the queue again, so that the editor either sees us waiting or has
+  // already taken what was queued.
+  __sync_add_and_fetch(&waitingToSend, 1);
+  while (asyncCommands.Size() >= MaxAsyncCommands && running)
+  {
+    pthread_cond_wait(&sent, &sendMutex);
+  }
+  __sync_sub_and_fetch(&waitingToSend, 1);
+  pthread_mutex_unlock(&sendMutex);
+}
+
+void Editor::Internals::WakeSenders()
+{
+  if (__sync_add_and_fetch(&waitingToSend, 0))
+  {
+    pthread_mutex_lock(&sendMutex);
+    pthread_cond_broadcast(&sent);
+    pthread_mutex_unlock(&sendMutex);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Queue \p command to be run on the editor's thread, and wake the editor. A burst of commands
+ *  wakes it once: only the command which finds the queue empty writes to the terminal's interrupt
+ *  pipe, as the editor takes the whole queue when it wakes.
+ *
+ *  While Run() is editing, a thread which gets MaxAsyncCommands ahead of it waits for it to catch
+ *  up, as it used to when the interrupt pipe filled, so that a flood of commands can't leave the
+ *  editor ever further behind. An embedded editor's queue isn't bounded: Process() takes it.
+ */
+//--------------------------------------------------------------------------------------------------
 void Editor::AsyncCommand(const Command *command)
 {
-  internals->asyncCommands.Push(command);
-  if (internals->terminal)
+  internals->WaitToSend();
+  if (internals->asyncCommands.Push(command) && internals->terminal)
   {
     internals->terminal->AsyncInterruptWaitForKey();
   }
 }
 
+//--------------------------------------------------------------------------------------------------
+/*! Print \p text above the line being edited, from any thread. Lines are gathered up and printed in
+ *  batches, each costing one redraw of the text being edited, at most every PrintIntervalMs; so a
+ *  flood of them doesn't turn into a flood of redraws. Like AsyncCommand(), it wakes the editor
+ *  once for a burst. With an embedded terminal, call Process() afterwards.
+ *
+ *  Nothing waits for the text to be printed. Once MaxQueuedPrints are waiting, more is dropped,
+ *  and the next batch says how much was.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::PrintAbove(const std::string &text)
+{
+  if (internals->printQueue.Size() >= Internals::MaxQueuedPrints)
+  {
+    __sync_add_and_fetch(&internals->printDropped, 1);
+    return;
+  }
+  if (internals->printQueue.Push(text) && internals->terminal)
+  {
+    internals->terminal->AsyncInterruptWaitForKey();
+  }
+}
+
+void Editor::Internals::AddPrinted(const std::string &text)
+{
+  printed += text;
+  if (text.empty() || text[text.size() - 1] != '\n')
+  {
+    printed += '\n';
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Print everything queued by PrintAbove(), in one go, unless it's too soon after the last time.
+ *  The text stays queued until then, so that more doesn't wake the editor.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Internals::PrintQueued()
+{
+  if (!terminal || GetPrintTimeout() != 0)
+  {
+    return;
+  }
+  printed.clear();
+  printQueue.Drain(boost::bind(&Internals::AddPrinted, this, _1));
+  if (const long dropped = __sync_lock_test_and_set(&printDropped, 0))
+  {
+    std::ostringstream note;
+    note << "[" << dropped << " more not shown]";
+    AddPrinted(note.str());
+  }
+  terminal->PrintAbove(printed);
+  gettimeofday(&lastPrinted, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Milliseconds until PrintQueued() can print what's queued, or -1 if nothing is.
+ */
+//--------------------------------------------------------------------------------------------------
+int Editor::Internals::GetPrintTimeout() const
+{
+  if (printQueue.Empty())
+  {
+    return -1;
+  }
+  timeval now;
+  gettimeofday(&now, 0);
+  const long elapsedMs = (now.tv_sec - lastPrinted.tv_sec) * 1000L +
+    (now.tv_usec - lastPrinted.tv_usec) / 1000;
+  return std::max(PrintIntervalMs - elapsedMs, 0L);
+}
+
 //! Read a line of input.
-void Editor::Run(bool noTerminal /*= false*/) { internals->Run(noTerminal); }
+void Editor::Run(bool noTerminal /*= false*/) { internals->Run(noTerminal ? 0 : new Terminal); }
+//! Read a line of input on the tty open as \p inFd and \p outFd, of type \p termType.
+void Editor::Run(int inFd, int outFd, const std::string &termType)
+{
+  internals->Run(new Terminal(inFd, outFd, termType));
+}
 Terminal *Editor::GetTerminal() const { return internals->terminal; }
+
+//--------------------------------------------------------------------------------------------------
+/*! Record the terminal's input into \p recording, for Recording::Replay(). Each terminal the editor
+ *  goes on to use starts the recording afresh. 0 stops recording.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::SetRecording(Recording *recording)
+{
+  internals->recording = recording;
+  if (internals->terminal)
+  {
+    internals->terminal->SetRecording(recording);
+  }
+}
+EventLoop &Editor::GetEventLoop() { return internals->eventLoop; }
 Mode *Editor::GetMode() const { return internals->mode; }
 
+//--------------------------------------------------------------------------------------------------
+/*! Start editing on an embedded terminal of type \p termType, for an application which does the
+ *  I/O itself. Instead of Run() reading and writing the terminal, the application passes in what
+ *  it reads with Feed(), and writes whatever TakeOutput() gives it whenever it likes. None of the
+ *  calls block, and nothing is shared between editors, so one thread can drive many.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Open(const std::string &termType, int rows, int columns)
+{
+  Close();
+  internals->terminal = new Terminal(termType, rows, columns,
+                                     boost::bind(&Internals::Write, internals, _1, _2));
+  if (internals->recording)
+  {
+    internals->terminal->SetRecording(internals->recording);
+  }
+  Process();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Stop editing on the embedded terminal, committing the text to it. The output still has to be
+ *  taken with TakeOutput().
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Close()
+{
+  delete internals->terminal;
+  internals->terminal = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Handle input read from the embedded terminal.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Feed(const char *data, size_t size)
+{
+  if (internals->terminal)
+  {
+    internals->terminal->Feed(data, size);
+    Process();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Tell the editor that the embedded terminal has changed size.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Resize(int rows, int columns)
+{
+  if (internals->terminal)
+  {
+    internals->terminal->Resize(rows, columns);
+    Process();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Handle the keys which are ready and any AsyncCommand()s, then update the display. Feed() and
+ *  Resize() do this themselves; otherwise, call it after AsyncCommand(), or once GetTimeout() has
+ *  passed.
+ */
+//--------------------------------------------------------------------------------------------------
+void Editor::Process()
+{
+  Terminal *terminal = internals->terminal;
+  if (!terminal)
+  {
+    return;
+  }
+  while (internals->mode && terminal->HaveKey())
+  {
+    internals->HandleKey(terminal->GetKey());
+  }
+  internals->RunAsyncCommands();
+  if (Mode *mode = internals->mode)
+  {
+    mode->Idle();
+    mode->Render(*terminal);
+    internals->PrintQueued();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! How long, in milliseconds, until Process() should be called if no more input comes in: when an
+ *  incomplete escape sequence will be taken as it stands, or PrintAbove() text can be printed. -1
+ *  if there's nothing to wait for.
+ */
+//--------------------------------------------------------------------------------------------------
+int Editor::GetTimeout() const
+{
+  if (!internals->terminal)
+  {
+    return -1;
+  }
+  const int input = internals->terminal->GetInputTimeout(), print = internals->GetPrintTimeout();
+  return input < 0 ? print : print < 0 ? input : std::min(input, print);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Take the output to be written to the embedded terminal, replacing the contents of \p output.
+ *  \return \c false if there is none.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Editor::TakeOutput(std::string &output)
+{
+  output.clear();
+  output.swap(internals->output);
+  return !output.empty();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Is the editor still editing? It finishes when its mode ends, as on end of file.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Editor::IsOpen() const
+{
+  return internals->terminal && internals->mode;
+}
+
 void Editor::EndMode()
 {
   delete internals->mode;
@@ -15,15 +15,49 @@ namespace Redline
 
     //! Read lines of input.
     void Run(bool noTerminal = false);
+    //! Read lines of input from a tty other than the process's own.
+    void Run(int inFd, int outFd, const std::string &termType = std::string());
+
+    //! Embedding: rather than Run(), the application feeds in input and takes the output.
+    //@{
+    //! Start editing on an embedded terminal of type \p termType.
+    void Open(const std::string &termType, int rows, int columns);
+    //! Stop editing, committing the text.
+    void Close();
+    //! Handle input from the terminal.
+    void Feed(const char *data, size_t size);
+    //! The terminal has changed size.
+    void Resize(int rows, int columns);
+    //! Handle anything due without new input, and update the display.
+    void Process();
+    //! Milliseconds until Process() has something to do, or -1.
+    int GetTimeout() const;
+    //! Take the output to be written to the terminal.
+    bool TakeOutput(std::string &output);
+    //! Has the mode not yet ended?
+    bool IsOpen() const;
+    //@}
 
     //! Send a command asynchronously, from another thread.
     /*! Takes ownership of \p command, which must have been allocated by \c new.
      */
     void AsyncCommand(const Command *command);
 
+    //! Print \p text above the line being edited, from any thread.
+    void PrintAbove(const std::string &text);
+
     //! Get the current terminal, if any.
     Terminal *GetTerminal() const;
 
+    //! Record the input of the terminal, and of those used later, into \p recording; 0 to stop.
+    void SetRecording(Recording *recording);
+
+    //! Get the event loop Run() waits for keys in.
+    /*! Fds watched here are handled on the thread calling Run(), while it waits for keys. The
+     *  display is updated after their handlers are called. Not used if Run() has no terminal.
+     */
+    EventLoop &GetEventLoop();
+
     //! Get the current mode.
     Mode *GetMode() const;
 
@@ -5,6 +5,12 @@
 #include <signal.h>
 //@}
 
+//! For history metadata.
+//@{
+#include <sys/time.h>
+#include <unistd.h>
+//@}
+
 #include <map>
 #include <memory>
 #include <sstream>
@@ -69,6 +75,38 @@ namespace
 
   void InsertNewline(EmacsMode &mode) { mode.GetText().Insert(InsertLeft, mode.GetCursor(), "\n"); }
   ModeCommand<EmacsMode> insertNewline("insert-newline", InsertNewline, bindings, Keys::Alt + Keys::Enter, Keys::Ctrl + Keys::Alt + 'M', Keys::Ctrl + Keys::Alt + 'J');
+
+  //! Insert pasted text all at once. Its line breaks become newlines in the text, rather than
+  //! accepting the line. Other control characters, such as the escape sequences of text copied
+  //! from a terminal, are dropped: drawn, they'd be run by the terminal. Tabs are kept.
+  void InsertPaste(EmacsMode &mode)
+  {
+    Terminal *t = mode.GetEditor().GetTerminal();
+    if (!t)
+    {
+      return;
+    }
+    const std::string &paste = t->GetPaste();
+    std::string add;
+    add.reserve(paste.size());
+    for (size_t n = 0; n < paste.size(); ++n)
+    {
+      const unsigned char c = paste[n];
+      if (c == '\r')
+      {
+        if (n + 1 == paste.size() || paste[n + 1] != '\n')
+        {
+          add += '\n';
+        }
+      }
+      else if ((c >= 0x20 && c != 0x7f) || c == '\n' || c == '\t')
+      {
+        add += c;
+      }
+    }
+    mode.GetText().Insert(InsertLeft, mode.GetCursor(), add);
+  }
+  ModeCommand<EmacsMode> insertPaste("insert-paste", InsertPaste, bindings, Keys::Paste);
   //@}
 
 
@@ -185,7 +223,7 @@ namespace
         t->Commit(/*addNewline=*/false);
 
         SuspendTerminal suspend(*t);
-        kill(-tcgetpgrp(0), SIGINT);
+        t->SignalForeground(SIGINT);
         // Simulate a race condition in editline
         mode.Execute("");
       }
@@ -209,7 +247,7 @@ namespace
       t->Commit();
 
       SuspendTerminal suspend(*t);
-      kill(-tcgetpgrp(0), SIGQUIT);
+      t->SignalForeground(SIGQUIT);
     }
   }
   Command sigquit("sigquit", SigQuit, bindings, Keys::Quit);
@@ -221,7 +259,7 @@ namespace
       t->Commit(/*addNewline =*/false);
 
       SuspendTerminal suspend(*t);
-      kill(-tcgetpgrp(0), SIGTSTP);
+      t->SignalForeground(SIGTSTP);
 
       // Text gets shown again by Editor.
     }
@@ -315,7 +353,10 @@ namespace
       } while (baseMode.HistoryPrevious());
 
       // No match!
-      Terminal::Bell();
+      if (Terminal *t = baseMode.GetEditor().GetTerminal())
+      {
+        t->Bell();
+      }
       positions.back().Activate(baseMode);
       return false;
     }
@@ -430,6 +471,8 @@ public:
   HistoryCursor historyPosition;
   bool tabCompleting;
   std::string hintText;
+  //! Reused for each frame, to avoid reallocating it.
+  DecoratedText frame;
 
   typedef std::map<HistoryCursor, std::string> HistoryEdits;
   HistoryEdits historyEdits;
@@ -476,7 +519,8 @@ const Command *EmacsMode::GetHandler(const KeyCombination &keys)
 
 void EmacsMode::Render(Terminal &terminal)
 {
-  DecoratedText dt;
+  DecoratedText &dt = internals->frame;
+  dt.Clear();
   int row, col;
   Render(dt, row, col);
   terminal.SetText(dt, row, col);
@@ -532,7 +576,8 @@ void EmacsMode::Render(DecoratedText &dt, int &row, int &col)
   }
   if (startLine == 0 && endLine == text.GetNumLines() && !internals->hintText.empty())
   {
-    dt.Add(Attributes::Normal, "\n" + internals->hintText);
+    dt.Add(Attributes::Normal, "\n");
+    dt.Add(Attributes::Hint, internals->hintText);
   }
 
   row -= startLine;
@@ -614,7 +659,10 @@ void EmacsMode::TabComplete()
   // Is the completion unique? If not, beep.
   if (matchset.size() != 1)
   {
-    Terminal::Bell();
+    if (Terminal *t = GetEditor().GetTerminal())
+    {
+      t->Bell();
+    }
   }
   else
   {
@@ -692,6 +740,29 @@ bool EmacsMode::AcceptLine()
   }
 }
 
+namespace
+{
+  //------------------------------------------------------------------------------------------------
+  /*! Find the newest entry of \p history which is \p text, or 0 if there is none. That's where
+   *  Add() put it, or the entry it was merged with, even if the command has since added entries or
+   *  trimmed the history.
+   */
+  //------------------------------------------------------------------------------------------------
+  HistoryCursor FindNewest(History &history, const std::string &text)
+  {
+    const HistoryCursor begin = history.Begin();
+    for (HistoryCursor pos = history.End(); pos && pos != begin; /**/)
+    {
+      pos = history.Previous(pos);
+      if (pos && history.Get(pos) == text)
+      {
+        return pos;
+      }
+    }
+    return 0;
+  }
+}
+
 bool EmacsMode::TextIsComplete()
 {
   return true;
@@ -714,9 +785,30 @@ void EmacsMode::DoExecute(const std::string &text, void *arg)
   {
     h->Add(text);
   }
+
+  timeval start;
+  gettimeofday(&start, 0);
   Execute(text, arg);
+
   if (History *h = GetHistory())
   {
+    timeval end;
+    gettimeofday(&end, 0);
+
+    HistoryMetadata metadata;
+    metadata.timestamp = start.tv_sec;
+    metadata.duration = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)))
+    {
+      metadata.directory = cwd;
+    }
+    GetHistoryMetadata(metadata);
+    if (HistoryCursor pos = FindNewest(*h, text))
+    {
+      h->SetMetadata(pos, metadata);
+    }
+
     SetHistoryPositionToEnd();
   }
 
@@ -736,6 +828,7 @@ Cursor EmacsMode::GetCursor() const { return internals->cursor; }
 void EmacsMode::SetCursor(const Cursor &cursor) { internals->cursor = cursor; }
 
 History *EmacsMode::GetHistory() { return 0; }
+void EmacsMode::GetHistoryMetadata(HistoryMetadata &) {}
 
 HistoryCursor EmacsMode::Internals::GetHistoryPosition(History *h)
 {
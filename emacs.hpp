@@ -57,6 +57,9 @@ namespace Redline
     virtual std::string GetPrompt(int line);
 
     virtual History *GetHistory();
+    //! Called after Execute, to fill in the exit status and session of the command just run. The
+    //! timestamp, duration and directory have already been filled in.
+    virtual void GetHistoryMetadata(HistoryMetadata &metadata);
 
   private:
     class Internals;
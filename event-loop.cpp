@@ -0,0 +1,295 @@
+#include "redline/event-loop.hpp"
+
+#include <map>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+using namespace Redline;
+
+namespace
+{
+  //! A watched file descriptor.
+  struct Watched
+  {
+    unsigned events;
+    EventLoop::Handler handler;
+    //! Tells apart successive watches on the same fd, so that an fd which is unwatched and watched
+    //! again by a handler doesn't receive events meant for the old watch.
+    unsigned long serial;
+  };
+
+  //! An fd which was found ready, waiting for its handler to be called.
+  struct Ready
+  {
+    Ready(int _fd, unsigned _events, unsigned long _serial) :
+      fd(_fd), events(_events), serial(_serial) {}
+    int fd;
+    unsigned events;
+    unsigned long serial;
+  };
+}
+
+class EventLoop::Internals
+{
+public:
+  Internals(Backend backend);
+  ~Internals();
+
+  Backend backend;
+  std::map<int, Watched> watches;
+  unsigned long serial;
+
+  //! poll: the array passed to poll(), rebuilt from watches when they change.
+  //@{
+  std::vector<pollfd> pollFds;
+  bool pollFdsChanged;
+  void PollWait(int timeoutMs, std::vector<Ready> &ready);
+  //@}
+
+  //! epoll: the epoll instance, created when the first fd is watched, and the events it returned.
+  //@{
+  int epollFd;
+#ifdef __linux__
+  void EpollCreate();
+  std::vector<epoll_event> epollEvents;
+  void EpollControl(int op, int fd, unsigned events);
+  void EpollWait(int timeoutMs, std::vector<Ready> &ready);
+#endif
+  //@}
+
+  std::vector<Ready> ready;
+};
+
+EventLoop::Internals::Internals(Backend _backend) :
+  backend(PollBackend), serial(), pollFdsChanged(false), epollFd(-1)
+{
+#ifdef __linux__
+  if (_backend != PollBackend)
+  {
+    backend = EpollBackend;
+  }
+#else
+  (void)_backend;
+#endif
+}
+
+EventLoop::Internals::~Internals()
+{
+  if (epollFd >= 0)
+  {
+    close(epollFd);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Translate our Events to poll's.
+ */
+//--------------------------------------------------------------------------------------------------
+static short ToPoll(unsigned events)
+{
+  return (events & EventLoop::Readable ? POLLIN : 0) | (events & EventLoop::Writable ? POLLOUT : 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Translate poll's events to ours. A hangup is reported as readable as well as an error, so that
+ *  a handler which only reads sees the end of file.
+ */
+//--------------------------------------------------------------------------------------------------
+static unsigned FromPoll(short events)
+{
+  return (events & (POLLIN | POLLHUP) ? unsigned(EventLoop::Readable) : 0) |
+    (events & POLLOUT ? unsigned(EventLoop::Writable) : 0) |
+    (events & (POLLERR | POLLHUP | POLLNVAL) ? unsigned(EventLoop::Error) : 0);
+}
+
+void EventLoop::Internals::PollWait(int timeoutMs, std::vector<Ready> &ready)
+{
+  if (pollFdsChanged)
+  {
+    pollFds.clear();
+    for (std::map<int, Watched>::const_iterator it = watches.begin(); it != watches.end(); ++it)
+    {
+      pollfd p = { it->first, ToPoll(it->second.events), 0 };
+      pollFds.push_back(p);
+    }
+    pollFdsChanged = false;
+  }
+
+  const int n = poll(pollFds.empty() ? 0 : &pollFds[0], pollFds.size(), timeoutMs);
+  for (size_t i = 0, found = 0; n > 0 && i < pollFds.size() && found < size_t(n); ++i)
+  {
+    if (pollFds[i].revents)
+    {
+      ++found;
+      ready.push_back(Ready(pollFds[i].fd, FromPoll(pollFds[i].revents),
+                            watches[pollFds[i].fd].serial));
+    }
+  }
+}
+
+#ifdef __linux__
+//--------------------------------------------------------------------------------------------------
+/*! Create the epoll instance, or fall back to poll if we can't. It's left until it's needed, so
+ *  that an editor which is never waited on, like an embedded one, doesn't use up an fd.
+ */
+//--------------------------------------------------------------------------------------------------
+void EventLoop::Internals::EpollCreate()
+{
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd >= 0)
+  {
+    epollEvents.resize(64);
+  }
+  else
+  {
+    backend = PollBackend;
+  }
+}
+
+void EventLoop::Internals::EpollControl(int op, int fd, unsigned events)
+{
+  epoll_event e = epoll_event();
+  e.events = (events & Readable ? uint32_t(EPOLLIN) : 0) | (events & Writable ? uint32_t(EPOLLOUT) : 0);
+  e.data.fd = fd;
+  epoll_ctl(epollFd, op, fd, &e);
+}
+
+void EventLoop::Internals::EpollWait(int timeoutMs, std::vector<Ready> &ready)
+{
+  const int n = epoll_wait(epollFd, &epollEvents[0], epollEvents.size(), timeoutMs);
+  for (int i = 0; i < n; ++i)
+  {
+    const uint32_t events = epollEvents[i].events;
+    const int fd = epollEvents[i].data.fd;
+    ready.push_back(Ready(fd,
+      (events & (EPOLLIN | EPOLLHUP) ? unsigned(Readable) : 0) |
+      (events & EPOLLOUT ? unsigned(Writable) : 0) |
+      (events & (EPOLLERR | EPOLLHUP) ? unsigned(Error) : 0), watches[fd].serial));
+  }
+  if (size_t(n) == epollEvents.size())
+  {
+    // Busy: take more at a time.
+    epollEvents.resize(epollEvents.size() * 2);
+  }
+}
+#endif
+
+EventLoop::EventLoop(Backend backend) :
+  internals(new Internals(backend))
+{
+}
+
+EventLoop::~EventLoop()
+{
+  delete internals;
+}
+
+EventLoop::Backend EventLoop::GetBackend() const
+{
+  return internals->backend;
+}
+
+void EventLoop::Watch(int fd, unsigned events, const Handler &handler)
+{
+  const bool existing = IsWatched(fd);
+  Watched &watch = internals->watches[fd];
+  watch.events = events;
+  watch.handler = handler;
+  watch.serial = ++internals->serial;
+  internals->pollFdsChanged = true;
+#ifdef __linux__
+  if (internals->backend == EpollBackend && internals->epollFd < 0)
+  {
+    internals->EpollCreate();
+  }
+  if (internals->backend == EpollBackend)
+  {
+    internals->EpollControl(existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, events);
+  }
+#else
+  (void)existing;
+#endif
+}
+
+void EventLoop::Modify(int fd, unsigned events)
+{
+  std::map<int, Watched>::iterator it = internals->watches.find(fd);
+  if (it == internals->watches.end())
+  {
+    return;
+  }
+  it->second.events = events;
+  internals->pollFdsChanged = true;
+#ifdef __linux__
+  if (internals->backend == EpollBackend)
+  {
+    internals->EpollControl(EPOLL_CTL_MOD, fd, events);
+  }
+#endif
+}
+
+void EventLoop::Unwatch(int fd)
+{
+  if (!internals->watches.erase(fd))
+  {
+    return;
+  }
+  internals->pollFdsChanged = true;
+#ifdef __linux__
+  if (internals->backend == EpollBackend)
+  {
+    internals->EpollControl(EPOLL_CTL_DEL, fd, 0);
+  }
+#endif
+}
+
+bool EventLoop::IsWatched(int fd) const
+{
+  return internals->watches.count(fd) != 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Wait for events, then call the handlers. The ready fds are all collected before any handler is
+ *  called, and each is looked up again just before its handler is, because handlers may watch and
+ *  unwatch fds, or call Wait() themselves.
+ */
+//--------------------------------------------------------------------------------------------------
+int EventLoop::Wait(int timeoutMs)
+{
+  std::vector<Ready> ready;
+  ready.swap(internals->ready);
+  ready.clear();
+#ifdef __linux__
+  if (internals->epollFd >= 0)
+  {
+    internals->EpollWait(timeoutMs, ready);
+  }
+  else
+#endif
+  {
+    internals->PollWait(timeoutMs, ready);
+  }
+
+  int handled = 0;
+  for (size_t i = 0; i < ready.size(); ++i)
+  {
+    std::map<int, Watched>::const_iterator it = internals->watches.find(ready[i].fd);
+    if (it == internals->watches.end() || it->second.serial != ready[i].serial)
+    {
+      continue;
+    }
+    // Copied, as the handler may unwatch its own fd.
+    const Handler handler = it->second.handler;
+    handler(ready[i].fd, ready[i].events);
+    ++handled;
+  }
+
+  // Keep the allocation for next time.
+  internals->ready.swap(ready);
+  return handled;
+}
@@ -0,0 +1,69 @@
+#ifndef REDLINE_EVENT_LOOP_HPP_INCLUDED
+#define REDLINE_EVENT_LOOP_HPP_INCLUDED
+
+#include "redline/forward-decls.hpp"
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace Redline
+{
+  //------------------------------------------------------------------------------------------------
+  /*! Watches file descriptors and calls a handler for each one which becomes ready. The editor
+   *  waits for keys in one of these, so an application can watch its own sockets and pipes on the
+   *  editor's thread, without threads or AsyncCommand() to wake it.
+   */
+  //------------------------------------------------------------------------------------------------
+  class EventLoop : boost::noncopyable
+  {
+  public:
+    //! Events to watch for, and which have happened.
+    enum Events
+    {
+      Readable = 1,
+      Writable = 2,
+      //! An error or hangup. Always reported, whether or not it was asked for.
+      Error = 4
+    };
+
+    //! The way file descriptors are waited for.
+    enum Backend
+    {
+      //! epoll where it's available, otherwise poll.
+      BestBackend,
+      PollBackend,
+      EpollBackend
+    };
+
+    //! Called with the file descriptor and the Events which happened.
+    typedef boost::function<void(int fd, unsigned events)> Handler;
+
+    //! If \p backend isn't available, falls back to poll.
+    EventLoop(Backend backend = BestBackend);
+    ~EventLoop();
+
+    //! Which backend is in use.
+    Backend GetBackend() const;
+
+    //! Call \p handler when \p fd has any of \p events. Replaces any existing watch on \p fd.
+    void Watch(int fd, unsigned events, const Handler &handler);
+    //! Change the events \p fd is watched for.
+    void Modify(int fd, unsigned events);
+    //! Stop watching \p fd. Safe to call from a handler, for any fd.
+    void Unwatch(int fd);
+    //! Is \p fd being watched?
+    bool IsWatched(int fd) const;
+
+    //! Wait for up to \p timeoutMs (forever if negative) for watched fds to become ready, and call
+    //! their handlers.
+    /*! \return The number of handlers called.
+     */
+    int Wait(int timeoutMs);
+
+    class Internals;
+  private:
+    Internals *internals;
+  };
+}
+
+#endif
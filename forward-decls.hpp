@@ -8,11 +8,15 @@ namespace Redline
   class KeyBindings;
   class KeyCombination;
   class Terminal;
+  class EventLoop;
+  class Reactor;
+  class Recording;
   class DecoratedText;
   class Text;
   class Cursor;
   class Mode;
   class History;
+  struct HistoryMetadata;
 
   extern const KeyCombination NoKeyCombination;
 
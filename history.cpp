@@ -3,7 +3,7 @@
 using namespace Redline;
 
 VectorHistory::VectorHistory(size_t maxLines) :
-  lines(), start(), maxLines(maxLines)
+  lines(), dropped(), start(), maxLines(maxLines)
 {
 }
 
@@ -11,22 +11,159 @@ static size_t FromCursor(HistoryCursor c) { return reinterpret_cast<size_t>(c) -
 static HistoryCursor ToCursor(size_t n) { return reinterpret_cast<HistoryCursor>(n + 1); }
 
 HistoryCursor VectorHistory::Begin() { return ToCursor(start); }
-HistoryCursor VectorHistory::End() { return ToCursor(start + lines.size()); }
+HistoryCursor VectorHistory::End() { return ToCursor(start + lines.size() - dropped); }
 HistoryCursor VectorHistory::Next(HistoryCursor pos) { return ToCursor(FromCursor(pos) + 1); }
 HistoryCursor VectorHistory::Previous(HistoryCursor pos) { return ToCursor(FromCursor(pos) - 1); }
 
-std::string VectorHistory::Get(HistoryCursor pos)
+long VectorHistory::Index(HistoryCursor pos) const
 {
   size_t n = FromCursor(pos) - start;
-  return n < lines.size() ? lines[n] : std::string();
+  return n < lines.size() - dropped ? static_cast<long>(n + dropped) : -1;
+}
+
+std::string VectorHistory::Get(HistoryCursor pos)
+{
+  long n = Index(pos);
+  return n >= 0 ? lines[n] : std::string();
 }
 
 void VectorHistory::Add(const std::string &text)
 {
   lines.push_back(text);
-  if (lines.size() > maxLines)
+  timestamps.push_back(0);
+  durations.push_back(0);
+  exitStatuses.push_back(0);
+  directories.push_back(-1);
+  sessions.push_back(0);
+  if (lines.size() - dropped > maxLines)
   {
-    lines.pop_front();
+    ++dropped;
     ++start;
+    Trim();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Erase dropped entries from the front of the columns. Only done once as many entries have been
+ *  dropped as are live, so the cost of erasing is amortized over the Adds which dropped them.
+ */
+//--------------------------------------------------------------------------------------------------
+void VectorHistory::Trim()
+{
+  if (dropped < maxLines)
+  {
+    return;
+  }
+  lines.erase(lines.begin(), lines.begin() + dropped);
+  timestamps.erase(timestamps.begin(), timestamps.begin() + dropped);
+  durations.erase(durations.begin(), durations.begin() + dropped);
+  exitStatuses.erase(exitStatuses.begin(), exitStatuses.begin() + dropped);
+  directories.erase(directories.begin(), directories.begin() + dropped);
+  sessions.erase(sessions.begin(), sessions.begin() + dropped);
+  dropped = 0;
+}
+
+void VectorHistory::SetMetadata(HistoryCursor pos, const HistoryMetadata &metadata)
+{
+  long n = Index(pos);
+  if (n < 0)
+  {
+    return;
+  }
+
+  int directory = -1;
+  if (!metadata.directory.empty())
+  {
+    std::map<std::string, int>::iterator it = directoryIds.find(metadata.directory);
+    if (it == directoryIds.end())
+    {
+      it = directoryIds.insert(std::make_pair(metadata.directory, int(directoryNames.size()))).first;
+      directoryNames.push_back(metadata.directory);
+    }
+    directory = it->second;
+  }
+
+  timestamps[n] = metadata.timestamp;
+  durations[n] = metadata.duration;
+  exitStatuses[n] = metadata.exitStatus;
+  directories[n] = directory;
+  sessions[n] = metadata.session;
+}
+
+bool VectorHistory::GetMetadata(HistoryCursor pos, HistoryMetadata &metadata)
+{
+  long n = Index(pos);
+  if (n < 0)
+  {
+    return false;
+  }
+
+  metadata.timestamp = timestamps[n];
+  metadata.duration = durations[n];
+  metadata.exitStatus = exitStatuses[n];
+  metadata.directory = directories[n] >= 0 ? directoryNames[directories[n]] : std::string();
+  metadata.session = sessions[n];
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Find the entries matching a query. The directory is resolved to its interned id up front, so the
+ *  scan itself only compares integers. Each filter is applied as a separate branch-free pass over
+ *  one column, which the compiler can vectorize.
+ */
+//--------------------------------------------------------------------------------------------------
+void VectorHistory::Find(const HistoryQuery &query, std::vector<HistoryCursor> &matches) const
+{
+  int directory = -1;
+  if (!query.directory.empty())
+  {
+    std::map<std::string, int>::const_iterator it = directoryIds.find(query.directory);
+    if (it == directoryIds.end())
+    {
+      return;
+    }
+    directory = it->second;
+  }
+
+  const size_t begin = dropped, size = lines.size() - begin;
+  if (!size)
+  {
+    return;
+  }
+  std::vector<unsigned char> match(size, 1);
+  unsigned char *m = &match[0];
+
+  if (query.since)
+  {
+    const time_t *col = &timestamps[begin];
+    for (size_t n = 0; n < size; ++n) { m[n] &= col[n] >= query.since; }
+  }
+  if (query.until)
+  {
+    const time_t *col = &timestamps[begin];
+    for (size_t n = 0; n < size; ++n) { m[n] &= col[n] < query.until; }
+  }
+  if (query.failedOnly)
+  {
+    const int *col = &exitStatuses[begin];
+    for (size_t n = 0; n < size; ++n) { m[n] &= col[n] != 0; }
+  }
+  if (directory >= 0)
+  {
+    const int *col = &directories[begin];
+    for (size_t n = 0; n < size; ++n) { m[n] &= col[n] == directory; }
+  }
+  if (query.session != -1)
+  {
+    const int *col = &sessions[begin];
+    for (size_t n = 0; n < size; ++n) { m[n] &= col[n] == query.session; }
+  }
+
+  for (size_t n = 0; n < size; ++n)
+  {
+    if (m[n])
+    {
+      matches.push_back(ToCursor(start + n));
+    }
   }
 }
@@ -3,11 +3,47 @@
 
 #include "redline/forward-decls.hpp"
 
-#include <deque>
+#include <ctime>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace Redline
 {
+  //! Information about a command, recorded alongside its history entry.
+  struct HistoryMetadata
+  {
+    HistoryMetadata() : timestamp(), duration(), exitStatus(), directory(), session() {}
+
+    //! When the command was started.
+    time_t timestamp;
+    //! How long the command took to run, in milliseconds.
+    int duration;
+    //! Exit status of the command. Nonzero means failure.
+    int exitStatus;
+    //! Working directory the command was run in.
+    std::string directory;
+    //! Application-defined session identifier.
+    int session;
+  };
+
+  //! A filter over history metadata. Each field defaults to matching everything.
+  struct HistoryQuery
+  {
+    HistoryQuery() : since(), until(), failedOnly(false), directory(), session(-1) {}
+
+    //! Only match commands started at or after this time, if nonzero.
+    time_t since;
+    //! Only match commands started before this time, if nonzero.
+    time_t until;
+    //! Only match commands with a nonzero exit status.
+    bool failedOnly;
+    //! Only match commands run in this directory, if non-empty.
+    std::string directory;
+    //! Only match commands from this session, if not -1.
+    int session;
+  };
+
   //! History implementation.
   /*! All of the methods here are permitted to fail (by returning 0 or
    *  an empty string). This implies that 0 is not a valid HistoryCursor
@@ -32,9 +68,17 @@ namespace Redline
     virtual std::string Get(HistoryCursor) = 0;
     //! Add a new history entry at End().
     virtual void Add(const std::string &text) = 0;
+
+    //! Attach metadata to a history entry. Implementations may discard it.
+    virtual void SetMetadata(HistoryCursor, const HistoryMetadata &) {}
+    //! Get the metadata for a history entry. Returns false if there is none.
+    virtual bool GetMetadata(HistoryCursor, HistoryMetadata &) { return false; }
   };
 
   //! History implementation in terms of a simple list of strings.
+  /*! Metadata is held in one array per field rather than one struct per entry, so that queries
+   *  scan only the fields they filter on.
+   */
   class VectorHistory : public History
   {
   public:
@@ -49,8 +93,36 @@ namespace Redline
     virtual std::string Get(HistoryCursor);
     virtual void Add(const std::string &text);
 
+    virtual void SetMetadata(HistoryCursor, const HistoryMetadata &metadata);
+    virtual bool GetMetadata(HistoryCursor, HistoryMetadata &metadata);
+
+    //! Find all entries matching \p query, oldest first.
+    void Find(const HistoryQuery &query, std::vector<HistoryCursor> &matches) const;
+
   private:
-    std::deque<std::string> lines;
+    //! Index into the columns for a cursor, or -1 if it is out of range.
+    long Index(HistoryCursor pos) const;
+    //! Drop entries which have fallen out of the history.
+    void Trim();
+
+    //! One element per entry, for entries [dropped, lines.size()).
+    //@{
+    std::vector<std::string> lines;
+    std::vector<time_t> timestamps;
+    std::vector<int> durations;
+    std::vector<int> exitStatuses;
+    std::vector<int> directories;
+    std::vector<int> sessions;
+    //@}
+
+    //! Interned working directories. Entries without one have directory -1.
+    //@{
+    std::vector<std::string> directoryNames;
+    std::map<std::string, int> directoryIds;
+    //@}
+
+    //! Number of leading column elements which are no longer part of the history.
+    size_t dropped;
     size_t start;
     size_t maxLines;
   };
@@ -0,0 +1,692 @@
+#include "redline/reactor.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+#include "redline/editor.hpp"
+#include "redline/event-loop.hpp"
+
+using namespace Redline;
+
+namespace
+{
+  //------------------------------------------------------------------------------------------------
+  /*! One editor session, and the output waiting to be written to its fd.
+   */
+  //------------------------------------------------------------------------------------------------
+  struct Session : boost::noncopyable
+  {
+    Session(int _fd, const std::string &_termType, int _rows, int _columns,
+            const Reactor::Start &_start) :
+      fd(_fd), termType(_termType), rows(_rows), columns(_columns), start(_start), editor(),
+      socket(true), output(), written(), writing(false), timed(false)
+    {
+    }
+
+    int fd;
+    std::string termType;
+    int rows, columns;
+    Reactor::Start start;
+    Editor editor;
+    //! Whether fd is a socket, which is written with send(), so that a hangup doesn't raise SIGPIPE.
+    bool socket;
+
+    //! Output not yet written, from written onwards.
+    std::string output;
+    size_t written;
+    //! Whether the fd is being watched for room to write the rest.
+    bool writing;
+    //! Whether the session is in its worker's list of those waiting for an escape timeout.
+    bool timed;
+  };
+
+  //------------------------------------------------------------------------------------------------
+  /*! A worker thread, and the sessions it serves.
+   */
+  //------------------------------------------------------------------------------------------------
+  class Worker : boost::noncopyable
+  {
+  public:
+    Worker(std::vector<Worker *> &workers, int index);
+    ~Worker();
+
+    //! Start the thread. The workers steal from each other, so they must all exist first.
+    void Start();
+
+    //! Queue \p session to be started, by this worker or a thief. Any thread.
+    void HandOff(Session *session);
+    //! Is the worker waiting for something to do? Any thread.
+    bool IsWaiting();
+    //! Wake the worker from waiting, now or the next time it waits. Any thread.
+    void Wake();
+    //! Have the worker end its sessions and finish. Any thread.
+    void Stop();
+    void Join();
+
+    Reactor::WorkerStats GetStats();
+    size_t GetNumSessions();
+
+  private:
+    static void *Main(void *worker);
+    void Run();
+    void PinToCpu();
+
+    //! Start the sessions handed to this worker, or steal one.
+    /*! \return \c false if the worker has been stopped.
+     */
+    bool TakeHandOffs(bool &stole);
+    Session *Steal();
+    void StartSession(Session *session, bool stolen);
+    void EndSession(Session *session);
+    void OnSessionReady(Session *session, unsigned events);
+    void OnWake(int fd, unsigned events);
+    //! Write what the session's editor has output, as far as the fd will take it.
+    void WriteOutput(Session *session);
+    //! After the editor has done something: write its output, and end or time it as need be.
+    void Processed(Session *session);
+    int NextTimeout();
+    void ProcessTimeouts();
+
+    std::vector<Worker *> &workers;
+    int index;
+    pthread_t thread;
+    EventLoop loop;
+    std::set<Session *> sessions;
+    //! Sessions waiting for an escape sequence to time out.
+    std::vector<Session *> timed;
+
+    //! Shared with other threads, under mutex.
+    //@{
+    pthread_mutex_t mutex;
+    std::deque<Session *> handOffs;
+    bool waiting;
+    bool woken;
+    bool stopping;
+    Reactor::WorkerStats stats;
+    //@}
+    int wakeFd[2];
+  };
+}
+
+Worker::Worker(std::vector<Worker *> &_workers, int _index) :
+  workers(_workers), index(_index), thread(), loop(), sessions(), timed(), handOffs(),
+  waiting(false), woken(false), stopping(false), stats()
+{
+  pthread_mutex_init(&mutex, 0);
+  pipe(wakeFd);
+  fcntl(wakeFd[0], F_SETFL, O_NONBLOCK);
+  loop.Watch(wakeFd[0], EventLoop::Readable, boost::bind(&Worker::OnWake, this, _1, _2));
+}
+
+void Worker::Start()
+{
+  pthread_create(&thread, 0, &Worker::Main, this);
+}
+
+Worker::~Worker()
+{
+  close(wakeFd[0]);
+  close(wakeFd[1]);
+  pthread_mutex_destroy(&mutex);
+}
+
+void *Worker::Main(void *worker)
+{
+  static_cast<Worker *>(worker)->Run();
+  return 0;
+}
+
+void Worker::HandOff(Session *session)
+{
+  pthread_mutex_lock(&mutex);
+  handOffs.push_back(session);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool Worker::IsWaiting()
+{
+  pthread_mutex_lock(&mutex);
+  const bool result = waiting;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Wake the worker. Wakeups are coalesced: the pipe is only written to once until the worker has
+ *  read it.
+ */
+//--------------------------------------------------------------------------------------------------
+void Worker::Wake()
+{
+  pthread_mutex_lock(&mutex);
+  const bool write = !woken;
+  woken = true;
+  pthread_mutex_unlock(&mutex);
+  if (write)
+  {
+    const char wake = 0;
+    while (::write(wakeFd[1], &wake, 1) < 0 && errno == EINTR) {}
+  }
+}
+
+void Worker::OnWake(int fd, unsigned)
+{
+  pthread_mutex_lock(&mutex);
+  woken = false;
+  pthread_mutex_unlock(&mutex);
+  char drain[64];
+  while (read(fd, drain, sizeof(drain)) > 0) {}
+}
+
+void Worker::Stop()
+{
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_mutex_unlock(&mutex);
+  Wake();
+}
+
+void Worker::Join()
+{
+  pthread_join(thread, 0);
+}
+
+Reactor::WorkerStats Worker::GetStats()
+{
+  pthread_mutex_lock(&mutex);
+  const Reactor::WorkerStats result = stats;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+//! Sessions being served, and waiting to be.
+size_t Worker::GetNumSessions()
+{
+  pthread_mutex_lock(&mutex);
+  const size_t result = stats.sessions + handOffs.size();
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Keep the worker on one CPU, so that its sessions stay in that CPU's caches.
+ */
+//--------------------------------------------------------------------------------------------------
+void Worker::PinToCpu()
+{
+#ifdef __linux__
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 1)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+#endif
+}
+
+void Worker::Run()
+{
+  PinToCpu();
+  bool stole = false;
+  while (TakeHandOffs(stole))
+  {
+    // Having stolen, look for more straight away.
+    const int timeout = stole ? 0 : NextTimeout();
+    pthread_mutex_lock(&mutex);
+    waiting = timeout != 0 && handOffs.empty();
+    pthread_mutex_unlock(&mutex);
+    loop.Wait(waiting ? timeout : 0);
+    pthread_mutex_lock(&mutex);
+    waiting = false;
+    pthread_mutex_unlock(&mutex);
+    ProcessTimeouts();
+  }
+
+  while (!sessions.empty())
+  {
+    EndSession(*sessions.begin());
+  }
+  pthread_mutex_lock(&mutex);
+  std::deque<Session *> unstarted;
+  unstarted.swap(handOffs);
+  pthread_mutex_unlock(&mutex);
+  for (size_t n = 0; n < unstarted.size(); ++n)
+  {
+    close(unstarted[n]->fd);
+    delete unstarted[n];
+  }
+}
+
+bool Worker::TakeHandOffs(bool &stole)
+{
+  pthread_mutex_lock(&mutex);
+  if (stopping)
+  {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  std::deque<Session *> mine;
+  mine.swap(handOffs);
+  stats.sessions += mine.size();
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t n = 0; n < mine.size(); ++n)
+  {
+    StartSession(mine[n], false);
+  }
+
+  stole = false;
+  if (mine.empty())
+  {
+    if (Session *session = Steal())
+    {
+      StartSession(session, true);
+      stole = true;
+    }
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Take the most recently handed off session from the worker with the most waiting to be started.
+ *  A worker which hasn't taken its hand-offs is busy, so they'd otherwise wait for it.
+ */
+//--------------------------------------------------------------------------------------------------
+Session *Worker::Steal()
+{
+  Worker *victim = 0;
+  size_t victimWaiting = 0;
+  for (size_t n = 1; n < workers.size(); ++n)
+  {
+    Worker *worker = workers[(index + n) % workers.size()];
+    pthread_mutex_lock(&worker->mutex);
+    const size_t waiting = worker->handOffs.size();
+    pthread_mutex_unlock(&worker->mutex);
+    if (waiting > victimWaiting)
+    {
+      victim = worker;
+      victimWaiting = waiting;
+    }
+  }
+  if (!victim)
+  {
+    return 0;
+  }
+
+  Session *session = 0;
+  pthread_mutex_lock(&victim->mutex);
+  if (!victim->handOffs.empty())
+  {
+    session = victim->handOffs.back();
+    victim->handOffs.pop_back();
+  }
+  pthread_mutex_unlock(&victim->mutex);
+  if (session)
+  {
+    pthread_mutex_lock(&mutex);
+    ++stats.sessions;
+    pthread_mutex_unlock(&mutex);
+  }
+  return session;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Start a session: set up its fd, give its editor a mode, and draw the first frame.
+ */
+//--------------------------------------------------------------------------------------------------
+void Worker::StartSession(Session *session, bool stolen)
+{
+  const int fd = session->fd;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  if (isatty(fd))
+  {
+    termios data;
+    if (tcgetattr(fd, &data) == 0)
+    {
+      data.c_lflag &= ~(ECHO | ICANON | ISIG);
+      data.c_iflag &= ~(ISTRIP | INPCK);
+      data.c_cc[VMIN] = 1;
+      data.c_cc[VTIME] = 0;
+      tcsetattr(fd, TCSADRAIN, &data);
+    }
+    winsize size;
+    if ((!session->rows || !session->columns) && ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col)
+    {
+      session->rows = size.ws_row;
+      session->columns = size.ws_col;
+    }
+  }
+  session->rows = session->rows ? session->rows : 24;
+  session->columns = session->columns ? session->columns : 80;
+
+  pthread_mutex_lock(&mutex);
+  ++stats.started;
+  stats.stolen += stolen;
+  pthread_mutex_unlock(&mutex);
+
+  sessions.insert(session);
+  loop.Watch(fd, EventLoop::Readable, boost::bind(&Worker::OnSessionReady, this, session, _2));
+  session->start(session->editor);
+  session->editor.Open(session->termType, session->rows, session->columns);
+  Processed(session);
+}
+
+void Worker::EndSession(Session *session)
+{
+  session->editor.Close();
+  WriteOutput(session);
+  loop.Unwatch(session->fd);
+  close(session->fd);
+  if (session->timed)
+  {
+    timed.erase(std::find(timed.begin(), timed.end(), session));
+  }
+  sessions.erase(session);
+  delete session;
+
+  pthread_mutex_lock(&mutex);
+  --stats.sessions;
+  pthread_mutex_unlock(&mutex);
+}
+
+void Worker::OnSessionReady(Session *session, unsigned events)
+{
+  if (events & EventLoop::Writable)
+  {
+    WriteOutput(session);
+  }
+  if (!(events & (EventLoop::Readable | EventLoop::Error)))
+  {
+    return;
+  }
+
+  char input[4096];
+  const ssize_t n = read(session->fd, input, sizeof(input));
+  if (n > 0)
+  {
+    session->editor.Feed(input, n);
+    Processed(session);
+  }
+  else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+  {
+    EndSession(session);
+  }
+}
+
+void Worker::Processed(Session *session)
+{
+  WriteOutput(session);
+  if (!session->editor.IsOpen())
+  {
+    EndSession(session);
+  }
+  else if (!session->timed && session->editor.GetTimeout() >= 0)
+  {
+    timed.push_back(session);
+    session->timed = true;
+  }
+}
+
+void Worker::WriteOutput(Session *session)
+{
+  std::string more;
+  if (session->editor.TakeOutput(more))
+  {
+    if (session->output.empty())
+    {
+      session->output.swap(more);
+    }
+    else
+    {
+      session->output += more;
+    }
+  }
+
+  while (session->written < session->output.size())
+  {
+    const char *data = session->output.data() + session->written;
+    const size_t size = session->output.size() - session->written;
+    ssize_t n = session->socket ? send(session->fd, data, size, MSG_NOSIGNAL) : -1;
+    if (n < 0 && errno == ENOTSOCK)
+    {
+      session->socket = false;
+    }
+    if (!session->socket)
+    {
+      n = write(session->fd, data, size);
+    }
+    if (n >= 0)
+    {
+      session->written += n;
+    }
+    else if (errno == EAGAIN)
+    {
+      break;
+    }
+    else if (errno != EINTR)
+    {
+      // The session will end when the read fails.
+      session->written = session->output.size();
+    }
+  }
+  if (session->written == session->output.size())
+  {
+    session->output.clear();
+    session->written = 0;
+  }
+
+  const bool writing = !session->output.empty();
+  if (writing != session->writing && loop.IsWatched(session->fd))
+  {
+    session->writing = writing;
+    loop.Modify(session->fd, EventLoop::Readable | (writing ? EventLoop::Writable : 0));
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! How long to wait, in milliseconds, before the first escape sequence times out, or -1.
+ */
+//--------------------------------------------------------------------------------------------------
+int Worker::NextTimeout()
+{
+  int timeout = -1;
+  for (size_t n = 0; n < timed.size(); /**/)
+  {
+    const int left = timed[n]->editor.GetTimeout();
+    if (left < 0)
+    {
+      timed[n]->timed = false;
+      timed[n] = timed.back();
+      timed.pop_back();
+      continue;
+    }
+    timeout = timeout < 0 ? left : std::min(timeout, left);
+    ++n;
+  }
+  return timeout;
+}
+
+void Worker::ProcessTimeouts()
+{
+  std::vector<Session *> due;
+  for (size_t n = 0; n < timed.size(); ++n)
+  {
+    if (timed[n]->editor.GetTimeout() == 0)
+    {
+      due.push_back(timed[n]);
+    }
+  }
+  for (size_t n = 0; n < due.size(); ++n)
+  {
+    due[n]->editor.Process();
+    Processed(due[n]);
+  }
+}
+
+
+class Reactor::Internals
+{
+public:
+  Internals() : workers(), nextWorker(), stopped(false), adding()
+  {
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&added, 0);
+  }
+  ~Internals()
+  {
+    pthread_cond_destroy(&added);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  std::vector<Worker *> workers;
+  //! Under mutex.
+  //@{
+  //! Round robin of workers to hand sessions to.
+  size_t nextWorker;
+  bool stopped;
+  //! AddSession() calls handing off to the workers, which Stop() waits for, signalled by added.
+  int adding;
+  //@}
+  pthread_mutex_t mutex;
+  pthread_cond_t added;
+};
+
+Reactor::Reactor(int threads) :
+  internals(new Internals)
+{
+  if (threads <= 0)
+  {
+    threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  }
+  std::vector<Worker *> &workers = internals->workers;
+  for (int n = 0; n < threads; ++n)
+  {
+    workers.push_back(new Worker(workers, n));
+  }
+  for (int n = 0; n < threads; ++n)
+  {
+    workers[n]->Start();
+  }
+}
+
+Reactor::~Reactor()
+{
+  Stop();
+  delete internals;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Hand the session to the next worker in turn. If that worker is busy, wake one which is waiting,
+ *  so that it can steal the session rather than it waiting its turn.
+ *
+ *  The workers are used outside the lock, so the call counts as in flight until it's done with
+ *  them: Stop() waits for it, which keeps them alive, and means the hand-off is made before the
+ *  worker stops, so it's either started or closed by the worker.
+ */
+//--------------------------------------------------------------------------------------------------
+void Reactor::AddSession(int fd, const std::string &termType, int rows, int columns,
+                         const Start &start)
+{
+  pthread_mutex_lock(&internals->mutex);
+  const std::vector<Worker *> &workers = internals->workers;
+  Worker *worker = internals->stopped ? 0 : workers[internals->nextWorker++ % workers.size()];
+  internals->adding += worker != 0;
+  pthread_mutex_unlock(&internals->mutex);
+  if (!worker)
+  {
+    close(fd);
+    return;
+  }
+
+  worker->HandOff(new Session(fd, termType, rows, columns, start));
+  Worker *wake = worker;
+  if (!worker->IsWaiting())
+  {
+    for (size_t n = 0; n < workers.size(); ++n)
+    {
+      if (workers[n] != worker && workers[n]->IsWaiting())
+      {
+        wake = workers[n];
+        break;
+      }
+    }
+  }
+  wake->Wake();
+
+  pthread_mutex_lock(&internals->mutex);
+  if (--internals->adding == 0)
+  {
+    pthread_cond_broadcast(&internals->added);
+  }
+  pthread_mutex_unlock(&internals->mutex);
+}
+
+size_t Reactor::GetNumSessions() const
+{
+  pthread_mutex_lock(&internals->mutex);
+  size_t sessions = 0;
+  for (size_t n = 0; n < internals->workers.size(); ++n)
+  {
+    sessions += internals->workers[n]->GetNumSessions();
+  }
+  pthread_mutex_unlock(&internals->mutex);
+  return sessions;
+}
+
+int Reactor::GetNumWorkers() const
+{
+  return internals->workers.size();
+}
+
+Reactor::WorkerStats Reactor::GetWorkerStats(int worker) const
+{
+  return internals->workers[worker]->GetStats();
+}
+
+void Reactor::Stop()
+{
+  pthread_mutex_lock(&internals->mutex);
+  const bool stopped = internals->stopped;
+  internals->stopped = true;
+  while (internals->adding)
+  {
+    pthread_cond_wait(&internals->added, &internals->mutex);
+  }
+  pthread_mutex_unlock(&internals->mutex);
+  if (stopped)
+  {
+    return;
+  }
+
+  std::vector<Worker *> &workers = internals->workers;
+  for (size_t n = 0; n < workers.size(); ++n)
+  {
+    workers[n]->Stop();
+  }
+  for (size_t n = 0; n < workers.size(); ++n)
+  {
+    workers[n]->Join();
+  }
+  pthread_mutex_lock(&internals->mutex);
+  for (size_t n = 0; n < workers.size(); ++n)
+  {
+    delete workers[n];
+  }
+  workers.clear();
+  pthread_mutex_unlock(&internals->mutex);
+}
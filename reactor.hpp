@@ -0,0 +1,64 @@
+#ifndef REDLINE_REACTOR_HPP_INCLUDED
+#define REDLINE_REACTOR_HPP_INCLUDED
+
+#include "redline/forward-decls.hpp"
+
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace Redline
+{
+  //------------------------------------------------------------------------------------------------
+  /*! Serves many editor sessions, each on its own socket or tty, from a small pool of worker
+   *  threads. Each session is an embedded Editor (see Editor::Open()) whose I/O the reactor does.
+   *
+   *  New sessions are handed to the workers through a queue per worker. A worker with nothing to do
+   *  steals from the queues of busier ones. Once a worker has started a session, it does all of
+   *  that session's work, so the session's state stays in the caches of the core the worker is
+   *  pinned to.
+   */
+  //------------------------------------------------------------------------------------------------
+  class Reactor : boost::noncopyable
+  {
+  public:
+    //! Called on the worker's thread to give a new session's editor its mode.
+    typedef boost::function<void(Editor &editor)> Start;
+
+    //! Start \p threads workers, or one per CPU if it's 0.
+    Reactor(int threads = 0);
+    //! Stop().
+    ~Reactor();
+
+    //! Serve a session on \p fd, which is closed when the session's mode ends or the other end
+    //! hangs up. A tty is put into raw mode, and asked for its size if \p rows or \p columns is 0.
+    void AddSession(int fd, const std::string &termType, int rows, int columns, const Start &start);
+
+    //! Sessions being served, counting those not yet started.
+    size_t GetNumSessions() const;
+
+    //! What one worker has done.
+    struct WorkerStats
+    {
+      WorkerStats() : sessions(), started(), stolen() {}
+      //! Sessions it is serving now.
+      size_t sessions;
+      //! Sessions it has started.
+      size_t started;
+      //! Sessions it has started which were handed to another worker.
+      size_t stolen;
+    };
+    int GetNumWorkers() const;
+    WorkerStats GetWorkerStats(int worker) const;
+
+    //! End every session, closing their fds, and stop the workers.
+    void Stop();
+
+    class Internals;
+  private:
+    Internals *internals;
+  };
+}
+
+#endif
@@ -0,0 +1,336 @@
+#include "redline/recording.hpp"
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <sstream>
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+#include "redline/editor.hpp"
+
+using namespace Redline;
+
+namespace
+{
+  //! A read of the terminal, or a change of its size if data is empty.
+  struct Event
+  {
+    Event(long _usec, const std::string &_data, int _rows = 0, int _columns = 0) :
+      usec(_usec), data(_data), rows(_rows), columns(_columns) {}
+    //! Microseconds from the start of the recording.
+    long usec;
+    std::string data;
+    int rows, columns;
+  };
+
+  //! The first line of a saved recording, and of one saved before the terminal's settings were.
+  const char *const Magic = "redline-recording 2";
+  const char *const MagicVersion1 = "redline-recording 1";
+
+  long MicrosecondsSince(const timeval &start)
+  {
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec);
+  }
+}
+
+class Recording::Internals
+{
+public:
+  Internals() : termType(), rows(), columns(), escapeTimeout(), controlCharacters(),
+    syncOutput(false), start(), events() {}
+
+  std::string termType;
+  int rows, columns;
+  int escapeTimeout;
+  Terminal::ControlCharacters controlCharacters;
+  bool syncOutput;
+  timeval start;
+  std::vector<Event> events;
+};
+
+namespace
+{
+  //! Time \p editor doing \p what, and pass what it outputs to \p output.
+  /*! \return The microseconds it took. \p outputBytes is set to the size of the output.
+   */
+  template<typename What>
+  long Time(Editor &editor, What what, const Terminal::Writer &output, std::string &scratch,
+            size_t &outputBytes)
+  {
+    timeval started;
+    gettimeofday(&started, 0);
+    what(editor);
+    const long usec = MicrosecondsSince(started);
+    outputBytes = editor.TakeOutput(scratch) ? scratch.size() : 0;
+    if (outputBytes && output)
+    {
+      output(scratch.data(), scratch.size());
+    }
+    return usec;
+  }
+
+  //! What Replay() has the editor do.
+  //@{
+  struct Process
+  {
+    void operator()(Editor &editor) const { editor.Process(); }
+  };
+
+  struct Play
+  {
+    Play(const Event &_event) : event(_event) {}
+    void operator()(Editor &editor) const
+    {
+      if (event.data.empty())
+      {
+        editor.Resize(event.rows, event.columns);
+      }
+      else
+      {
+        editor.Feed(event.data.data(), event.data.size());
+      }
+    }
+    const Event &event;
+  };
+  //@}
+}
+
+Recording::Recording() :
+  internals(new Internals)
+{
+}
+
+Recording::~Recording()
+{
+  delete internals;
+}
+
+void Recording::Start(const std::string &termType, int rows, int columns, int escapeTimeout)
+{
+  internals->termType = termType;
+  internals->rows = rows;
+  internals->columns = columns;
+  internals->escapeTimeout = escapeTimeout;
+  internals->controlCharacters = Terminal::ControlCharacters();
+  internals->syncOutput = false;
+  internals->events.clear();
+  gettimeofday(&internals->start, 0);
+}
+
+void Recording::SetControlCharacters(const Terminal::ControlCharacters &characters)
+{
+  internals->controlCharacters = characters;
+}
+
+void Recording::SetSyncOutput(bool sync)
+{
+  internals->syncOutput = sync;
+}
+
+void Recording::AddInput(const char *data, size_t size)
+{
+  internals->events.push_back(Event(MicrosecondsSince(internals->start), std::string(data, size)));
+}
+
+void Recording::AddResize(int rows, int columns)
+{
+  internals->events.push_back(Event(MicrosecondsSince(internals->start), std::string(), rows,
+                                    columns));
+}
+
+const std::string &Recording::GetTermType() const { return internals->termType; }
+int Recording::GetNumRows() const { return internals->rows; }
+int Recording::GetNumColumns() const { return internals->columns; }
+int Recording::GetEscapeTimeout() const { return internals->escapeTimeout; }
+bool Recording::GetSyncOutput() const { return internals->syncOutput; }
+
+const Terminal::ControlCharacters &Recording::GetControlCharacters() const
+{
+  return internals->controlCharacters;
+}
+size_t Recording::GetNumEvents() const { return internals->events.size(); }
+
+const std::string &Recording::GetEventInput(size_t n) const
+{
+  return internals->events[n].data;
+}
+
+long Recording::GetDuration() const
+{
+  return internals->events.empty() ? 0 : internals->events.back().usec;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Save the recording. It's a header of a line per setting, then a line per event, each read
+ *  followed by the bytes read and a newline. The control characters are eof, susp, intr and quit.
+ *
+ *  \verbatim
+    redline-recording 2
+    term xterm
+    size 24 80
+    escape-timeout 1000
+    control-characters 4 26 3 28
+    sync-output 1
+    input 1234567 3
+    ^[[A
+    resize 2345678 30 100
+    \endverbatim
+ */
+//--------------------------------------------------------------------------------------------------
+void Recording::Write(std::ostream &out) const
+{
+  out << Magic << '\n'
+      << "term " << internals->termType << '\n'
+      << "size " << internals->rows << ' ' << internals->columns << '\n'
+      << "escape-timeout " << internals->escapeTimeout << '\n';
+  const Terminal::ControlCharacters &keys = internals->controlCharacters;
+  out << "control-characters " << keys.eof << ' ' << keys.susp << ' ' << keys.intr << ' '
+      << keys.quit << '\n'
+      << "sync-output " << internals->syncOutput << '\n';
+  for (size_t n = 0; n < internals->events.size(); ++n)
+  {
+    const Event &event = internals->events[n];
+    if (event.data.empty())
+    {
+      out << "resize " << event.usec << ' ' << event.rows << ' ' << event.columns << '\n';
+    }
+    else
+    {
+      out << "input " << event.usec << ' ' << event.data.size() << '\n';
+      out.write(event.data.data(), event.data.size());
+      out << '\n';
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Load a recording saved by Write(). One saved before the control characters and synchronized
+ *  output were has the defaults Start() gives them.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Recording::Read(std::istream &in)
+{
+  Start(std::string(), 0, 0, 0);
+  std::string line, word;
+  if (!std::getline(in, line) || (line != Magic && line != MagicVersion1))
+  {
+    return false;
+  }
+  const bool settings = line == Magic;
+  if (!std::getline(in, line) || line.compare(0, 5, "term ") != 0)
+  {
+    return false;
+  }
+  internals->termType = line.substr(5);
+  Terminal::ControlCharacters &keys = internals->controlCharacters;
+  if (!(in >> word >> internals->rows >> internals->columns) || word != "size" ||
+      !(in >> word >> internals->escapeTimeout) || word != "escape-timeout" ||
+      (settings &&
+       (!(in >> word >> keys.eof >> keys.susp >> keys.intr >> keys.quit) ||
+        word != "control-characters" ||
+        !(in >> word >> internals->syncOutput) || word != "sync-output")))
+  {
+    Start(std::string(), 0, 0, 0);
+    return false;
+  }
+
+  std::vector<Event> &events = internals->events;
+  while (in >> word)
+  {
+    long usec = 0;
+    size_t size = 0;
+    int rows = 0, columns = 0;
+    if (word == "input" && in >> usec >> size && size && in.get() == '\n')
+    {
+      std::string data(size, '\0');
+      in.read(&data[0], size);
+      if (in.gcount() == std::streamsize(size) && in.get() == '\n')
+      {
+        events.push_back(Event(usec, data));
+        continue;
+      }
+    }
+    else if (word == "resize" && in >> usec >> rows >> columns)
+    {
+      events.push_back(Event(usec, std::string(), rows, columns));
+      continue;
+    }
+    Start(std::string(), 0, 0, 0);
+    return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Play the recording back into \p editor, through an embedded terminal, so that the terminal maps
+ *  the same bytes to the same keys as it did when recording.
+ *
+ *  At RealTime, the gaps between events are waited out, and escape sequences time out as they
+ *  would have. AsFastAsPossible doesn't wait, so that the time taken is the editor's alone; escape
+ *  sequences time out wherever the recorded gap was longer than the timeout.
+ *
+ *  The totals in \p stats include the editor opening, and escape sequences timing out between
+ *  events, which the per-event figures don't. The first frame, drawn as the editor opens, is drawn
+ *  before the recorded settings are applied.
+ */
+//--------------------------------------------------------------------------------------------------
+void Recording::Replay(Editor &editor, Speed speed, ReplayStats &stats,
+                       const Terminal::Writer &output) const
+{
+  const Internals &r = *internals;
+  stats = ReplayStats();
+  std::string scratch;
+  size_t bytes = 0;
+
+  stats.usec += Time(editor, boost::bind(&Editor::Open, _1, r.termType, r.rows, r.columns),
+                       output, scratch, bytes);
+  stats.outputBytes += bytes;
+  Terminal *terminal = editor.GetTerminal();
+  terminal->SetEscapeTimeout(r.escapeTimeout);
+  terminal->SetControlCharacters(r.controlCharacters);
+  terminal->SetSyncOutput(r.syncOutput);
+
+  timeval start;
+  gettimeofday(&start, 0);
+  long previous = 0;
+  for (size_t n = 0; n < r.events.size() && editor.IsOpen(); ++n)
+  {
+    const Event &event = r.events[n];
+    if (speed == RealTime)
+    {
+      for (long wait; (wait = event.usec - MicrosecondsSince(start)) > 0; /**/)
+      {
+        const int timeout = editor.GetTimeout();
+        if (timeout == 0)
+        {
+          stats.usec += Time(editor, Process(), output, scratch, bytes);
+          stats.outputBytes += bytes;
+          continue;
+        }
+        usleep(timeout < 0 ? wait : std::min(wait, timeout * 1000L));
+      }
+    }
+    else if (r.escapeTimeout && editor.GetTimeout() >= 0 &&
+             event.usec - previous >= r.escapeTimeout * 1000L)
+    {
+      terminal->TimeOutInput();
+      stats.usec += Time(editor, Process(), output, scratch, bytes);
+      stats.outputBytes += bytes;
+    }
+    previous = event.usec;
+
+    const long usec = Time(editor, Play(event), output, scratch, bytes);
+    ++stats.events;
+    stats.inputBytes += event.data.size();
+    stats.usec += usec;
+    stats.outputBytes += bytes;
+    stats.eventUsec.push_back(usec);
+    stats.eventOutputBytes.push_back(bytes);
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef REDLINE_RECORDING_HPP_INCLUDED
+#define REDLINE_RECORDING_HPP_INCLUDED
+
+#include "redline/forward-decls.hpp"
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "redline/terminal.hpp"
+
+namespace Redline
+{
+  //------------------------------------------------------------------------------------------------
+  /*! The raw input of a terminal, as it was read, with when it was read, and changes of size. One
+   *  is filled in by a terminal it's given to (see Editor::SetRecording()), saved with Write() and
+   *  loaded with Read(), and played back into an editor with Replay().
+   */
+  //------------------------------------------------------------------------------------------------
+  class Recording : boost::noncopyable
+  {
+  public:
+    Recording();
+    ~Recording();
+
+    //! Recording: forget any earlier events, and start the clock, for a terminal of type
+    //! \p termType, of \p rows by \p columns, which times out escape sequences after
+    //! \p escapeTimeout milliseconds. It has the usual control characters and no synchronized
+    //! output, unless set otherwise.
+    void Start(const std::string &termType, int rows, int columns, int escapeTimeout);
+    //! Recording: the terminal's control characters, which decide what some input is read as.
+    void SetControlCharacters(const Terminal::ControlCharacters &characters);
+    //! Recording: whether the terminal brackets its frames with synchronized output.
+    void SetSyncOutput(bool sync);
+    //! Recording: the terminal has read \p size bytes at \p data.
+    void AddInput(const char *data, size_t size);
+    //! Recording: the terminal has changed size.
+    void AddResize(int rows, int columns);
+
+    const std::string &GetTermType() const;
+    int GetNumRows() const;
+    int GetNumColumns() const;
+    int GetEscapeTimeout() const;
+    const Terminal::ControlCharacters &GetControlCharacters() const;
+    bool GetSyncOutput() const;
+    //! Number of reads and changes of size recorded.
+    size_t GetNumEvents() const;
+    //! What event \p n read, or nothing if it was a change of size.
+    const std::string &GetEventInput(size_t n) const;
+    //! Microseconds from the start to the last event.
+    long GetDuration() const;
+
+    //! Save the recording to \p out.
+    void Write(std::ostream &out) const;
+    //! Load a recording saved by Write() from \p in.
+    /*! \return \c false if it isn't one, leaving the recording empty.
+     */
+    bool Read(std::istream &in);
+
+    enum Speed
+    {
+      //! With the recorded gaps between events.
+      RealTime,
+      //! Without waiting; escape sequences time out where they did when recorded.
+      AsFastAsPossible
+    };
+
+    //! What happened during a replay.
+    struct ReplayStats
+    {
+      ReplayStats() : events(), inputBytes(), outputBytes(), usec(), eventUsec(), eventOutputBytes() {}
+      size_t events;
+      size_t inputBytes;
+      size_t outputBytes;
+      //! Time spent by the editor handling the events, in microseconds, not counting waiting.
+      long usec;
+      //! For each event, usually a keypress, the time the editor spent handling it, and the
+      //! output that resulted.
+      //@{
+      std::vector<long> eventUsec;
+      std::vector<size_t> eventOutputBytes;
+      //@}
+    };
+
+    //! Play the recording back into \p editor, which must have a mode. It's opened as an embedded
+    //! terminal like the one recorded, with its control characters and synchronized output, and
+    //! left as the recording finishes: open, unless the input ended the mode. Its output is passed
+    //! to \p output, if given.
+    void Replay(Editor &editor, Speed speed, ReplayStats &stats,
+                const Terminal::Writer &output = Terminal::Writer()) const;
+
+    class Internals;
+  private:
+    Internals *internals;
+  };
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include "redline/terminal.hpp"
+// Before term.h, whose macros clash with names in it.
+#include "redline/recording.hpp"
 
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <deque>
@@ -7,13 +10,29 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <term.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "redline/bindings.hpp"
+#include "redline/event-loop.hpp"
 
 #define TERMINAL_USE_TCGETATTR
 
@@ -33,30 +52,30 @@ namespace
 #undef lines
 #undef columns
 
-  void GetTerminalSize(int &x, int &y)
+  //! Get the size of the tty open as \p fd. \return \c false if it can't be found.
+  bool GetTerminalSize(int fd, int &x, int &y)
   {
 #ifdef TIOCGSIZE
     ttysize size1;
-    if (ioctl(1, TIOCGSIZE, &size1) == 0)
+    if (ioctl(fd, TIOCGSIZE, &size1) == 0 && size1.ts_cols > 0)
     {
       x = size1.ts_cols;
       y = size1.ts_lines;
-      return;
+      return true;
     }
 #endif
 
 #ifdef TIOCGWINSZ
     winsize size2;
-    if (ioctl(1, TIOCGWINSZ, &size2) == 0)
+    if (ioctl(fd, TIOCGWINSZ, &size2) == 0 && size2.ws_col > 0)
     {
       x = size2.ws_col;
       y = size2.ws_row;
-      return;
+      return true;
     }
 #endif
 
-    x = TiColumns();
-    y = TiLines();
+    return false;
   }
 
   //------------------------------------------------------------------------------------------------
@@ -65,16 +84,17 @@ namespace
   //------------------------------------------------------------------------------------------------
   static bool IsValidTiStr(const char *str)
   {
-    return str && (str + 1) && *str;
+    return str && str != reinterpret_cast<const char *>(-1) && *str;
   }
 
   //------------------------------------------------------------------------------------------------
   /*! Get a terminfo string for a given capability, or 0 if none is available.
    */
   //------------------------------------------------------------------------------------------------
-  static char *GetTiStr(/*const*/ char *cap)
+  static char *GetTiStr(const char *cap)
   {
-    char *tiStr = tigetstr(cap);
+    // curses declares cap non-const, but doesn't change it.
+    char *tiStr = tigetstr(const_cast<char *>(cap));
     return IsValidTiStr(tiStr) ? tiStr : 0;
   }
 
@@ -82,61 +102,412 @@ namespace
   /*! Does the terminal have the given capability?
    */
   //------------------------------------------------------------------------------------------------
-  static bool HasTiFlag(/*const*/ char *cap)
+  static bool HasTiFlag(const char *cap)
   {
-    return tigetflag(cap) > 0;
+    return tigetflag(const_cast<char *>(cap)) > 0;
   }
 
   //------------------------------------------------------------------------------------------------
-  /*! Emit the given terminfo string.
+  /*! Append a terminfo string to an output buffer. Padding specifications ("$<5>") are dropped;
+   *  they only matter to hardware terminals at low baud rates, and honouring them would mean going
+   *  through tputs and stdio one character at a time.
    */
   //------------------------------------------------------------------------------------------------
-  static bool TiStr(/*const*/ char *cap)
+  static void AppendTiStr(std::string &out, const char *str)
   {
-    if (char *tiStr = GetTiStr(cap))
+    if (!strchr(str, '$'))
     {
-      putp(tiStr);
-      return true;
+      out += str;
+      return;
+    }
+    for (const char *p = str; *p; ++p)
+    {
+      if (p[0] == '$' && p[1] == '<')
+      {
+        const char *q = p + 2;
+        while (isdigit(*q) || *q == '.' || *q == '*' || *q == '/') { ++q; }
+        if (*q == '>')
+        {
+          p = q;
+          continue;
+        }
+      }
+      out += *p;
     }
-    return false;
   }
 
   //------------------------------------------------------------------------------------------------
-  /*! Initialize the terminal, and read the corresponding terminfo. Must be done before anything
-   *  else which uses terminfo.
-   *
-   *  This also puts the terminal into our desired state. Note that we make no attempt to undo this
-   *  when the Terminal is destroyed; that's largely because it's impossible to find out what the
-   *  original terminal state was.
+  /*! Write a whole buffer to a file descriptor. If it's nonblocking and full, wait until it can be
+   *  written to again.
+   *  \return The number of write() calls made.
+   */
+  //------------------------------------------------------------------------------------------------
+  static size_t WriteAll(int fd, const char *data, size_t size)
+  {
+    size_t writes = 0;
+    while (size)
+    {
+      ssize_t n = write(fd, data, size);
+      ++writes;
+      if (n < 0)
+      {
+        if (errno == EINTR) { continue; }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          // poll() rather than select(), which can't wait for fds past FD_SETSIZE.
+          pollfd writable = { fd, POLLOUT, 0 };
+          if (poll(&writable, 1, -1) >= 0 || errno == EINTR) { continue; }
+        }
+        break;
+      }
+      data += n;
+      size -= n;
+    }
+    return writes;
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! SIGWINCH handling. The handler marks the cached terminal size as stale and wakes up
+   *  DoWaitForKey through its self-pipe, which reports the resize as Keys::Resize.
+   */
+  //------------------------------------------------------------------------------------------------
+  volatile sig_atomic_t terminalResized = 1;
+  int resizeWakeFd = -1;
+  struct sigaction previousResizeAction;
+
+  //! The byte written to the self-pipe to report each kind of wakeup.
+  const char WakeInterrupt = 0, WakeResize = 1;
+
+  void OnResize(int signal)
+  {
+    const int savedErrno = errno;
+    terminalResized = 1;
+    if (resizeWakeFd >= 0)
+    {
+      write(resizeWakeFd, &WakeResize, 1);
+    }
+    // Let whoever was watching for resizes before us know too.
+    if (!(previousResizeAction.sa_flags & SA_SIGINFO) &&
+        previousResizeAction.sa_handler != SIG_DFL && previousResizeAction.sa_handler != SIG_IGN)
+    {
+      previousResizeAction.sa_handler(signal);
+    }
+    errno = savedErrno;
+  }
+
+  //! Microseconds from \p start to \p end.
+  long MicrosecondsBetween(const timeval &start, const timeval &end)
+  {
+    return (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! A ring buffer of bytes read from the terminal and not yet mapped to keys. Input is read into
+   *  it a chunk at a time, rather than with a read() per byte. Its capacity is always a power of
+   *  two, and it grows if it fills up.
+   */
+  //------------------------------------------------------------------------------------------------
+  class InputBuffer
+  {
+  public:
+    InputBuffer() : data(4096), head(), size() {}
+
+    bool Empty() const { return !size; }
+    size_t Size() const { return size; }
+    unsigned char Pop()
+    {
+      unsigned char c = data[head];
+      head = (head + 1) & (data.size() - 1);
+      --size;
+      return c;
+    }
+
+    //! Add \p count bytes at \p chars to the end of the buffer.
+    void Append(const char *chars, size_t count)
+    {
+      Reserve(size + count);
+      const size_t mask = data.size() - 1;
+      for (size_t n = 0; n < count; ++n)
+      {
+        data[(head + size++) & mask] = chars[n];
+      }
+    }
+
+    //! Read as much as is available from \p fd, and will fit, into the buffer.
+    /*! \return The result of the read.
+     */
+    ssize_t ReadFrom(int fd)
+    {
+      Reserve(size + 1);
+      const size_t capacity = data.size(), tail = (head + size) & (capacity - 1);
+      // The free space might wrap around the end of the buffer.
+      iovec space[2];
+      space[0].iov_base = &data[tail];
+      space[0].iov_len = (tail < head ? head : capacity) - tail;
+      space[1].iov_base = &data[0];
+      space[1].iov_len = tail < head ? 0 : head;
+      const ssize_t n = readv(fd, space, space[1].iov_len ? 2 : 1);
+      if (n > 0)
+      {
+        size += n;
+      }
+      return n;
+    }
+
+    //! Append the last \p count bytes in the buffer to \p to.
+    void CopyLast(size_t count, std::string &to) const
+    {
+      const size_t mask = data.size() - 1;
+      for (size_t n = size - count; n < size; ++n)
+      {
+        to += data[(head + n) & mask];
+      }
+    }
+
+  private:
+    void Reserve(size_t capacity)
+    {
+      if (capacity <= data.size())
+      {
+        return;
+      }
+      size_t newCapacity = data.size();
+      while (newCapacity < capacity) { newCapacity *= 2; }
+      std::vector<unsigned char> newData(newCapacity);
+      for (size_t n = 0; n < size; ++n)
+      {
+        newData[n] = data[(head + n) & (data.size() - 1)];
+      }
+      data.swap(newData);
+      head = 0;
+    }
+
+    std::vector<unsigned char> data;
+    size_t head, size;
+  };
+
+  //------------------------------------------------------------------------------------------------
+  /*! terminfo describes one terminal at a time, through the global cur_term, and tparm expands
+   *  into static storage. Terminals with their own terminal types take turns at it through this
+   *  lock. It's recursive, because loading capabilities expands some of them.
+   */
+  //------------------------------------------------------------------------------------------------
+  pthread_once_t termInfoOnce = PTHREAD_ONCE_INIT;
+  pthread_mutex_t termInfoMutex;
+
+  void InitTermInfoMutex()
+  {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&termInfoMutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+  }
+
+  class TermInfoLock : boost::noncopyable
+  {
+  public:
+    TermInfoLock()
+    {
+      pthread_once(&termInfoOnce, InitTermInfoMutex);
+      pthread_mutex_lock(&termInfoMutex);
+    }
+    ~TermInfoLock() { pthread_mutex_unlock(&termInfoMutex); }
+  };
+
+  //------------------------------------------------------------------------------------------------
+  /*! While this exists, terminfo describes \p termType, or $TERM if it's 0, so that its
+   *  capabilities can be loaded. Afterwards, whatever it described before is restored, so each
+   *  Terminal has its own capabilities and nothing is left behind in terminfo's globals. If there
+   *  is no entry for the type, terminfo describes nothing, so every capability is missing.
+   */
+  //------------------------------------------------------------------------------------------------
+  class TermInfoScope : boost::noncopyable
+  {
+  public:
+    TermInfoScope(const char *termType) : lock(), previous(cur_term), loaded()
+    {
+      int error;
+      if (setupterm(const_cast<char *>(termType), -1, &error) == 0)
+      {
+        loaded = cur_term;
+      }
+      else
+      {
+        set_curterm(0);
+      }
+    }
+    ~TermInfoScope()
+    {
+      set_curterm(previous);
+      if (loaded && loaded != previous)
+      {
+        del_curterm(loaded);
+      }
+    }
+
+  private:
+    TermInfoLock lock;
+    TERMINAL *previous, *loaded;
+  };
+
+  //------------------------------------------------------------------------------------------------
+  /*! Get a terminfo string with padding removed, or an empty string if none is available.
    */
   //------------------------------------------------------------------------------------------------
-  static void InitTerminal()
+  static std::string LoadTiStr(const char *cap)
   {
-    static bool doneInit = false;
-    if (!doneInit)
+    std::string result;
+    if (char *tiStr = GetTiStr(cap))
     {
-      doneInit = true;
-      setupterm(0, 1, 0);
+      AppendTiStr(result, tiStr);
     }
+    return result;
   }
 
   //------------------------------------------------------------------------------------------------
-  /*! Produce a bell. putchar('\a') on steroids.
+  /*! A parameterized terminfo string. Each expansion is produced by tparm the first time it is
+   *  needed and remembered, so redraws only ever copy strings.
    */
   //------------------------------------------------------------------------------------------------
-  static void TiBell() { TiStr("bel"); }
+  class TiParamStr
+  {
+  public:
+    TiParamStr() : str(), expansions() {}
+
+    void Load(const char *cap)
+    {
+      char *tiStr = GetTiStr(cap);
+      str = tiStr ? tiStr : "";
+      expansions.clear();
+    }
+
+    bool IsValid() const { return !str.empty(); }
+
+    //! Get the expansion for parameter \p param, which must be non-negative.
+    const std::string &Get(int param)
+    {
+      if (param >= static_cast<int>(expansions.size()))
+      {
+        expansions.resize(param + 1);
+      }
+      std::string &expansion = expansions[param];
+      if (expansion.empty())
+      {
+        TermInfoLock lock;
+        AppendTiStr(expansion, tparm(const_cast<char*>(str.c_str()), param));
+      }
+      return expansion;
+    }
+
+  private:
+    std::string str;
+    std::vector<std::string> expansions;
+  };
 
-  struct TerminalKeys
+  //------------------------------------------------------------------------------------------------
+  /*! The terminfo capabilities used for output, looked up once when the Terminal is created.
+   *  Missing string capabilities are empty.
+   */
+  //------------------------------------------------------------------------------------------------
+  struct TerminalCaps
   {
-    int eof, susp, intr, quit;
+    void Load()
+    {
+      cr = LoadTiStr("cr");
+      nel = LoadTiStr("nel");
+      cub1 = LoadTiStr("cub1");
+      cuf1 = LoadTiStr("cuf1");
+      cuu1 = LoadTiStr("cuu1");
+      cud1 = LoadTiStr("cud1");
+      civis = LoadTiStr("civis");
+      cnorm = LoadTiStr("cnorm");
+      clear = LoadTiStr("clear");
+      smkx = LoadTiStr("smkx");
+      rmkx = LoadTiStr("rmkx");
+      ich1 = LoadTiStr("ich1");
+      dch1 = LoadTiStr("dch1");
+      el = LoadTiStr("el");
+      il1 = LoadTiStr("il1");
+      dl1 = LoadTiStr("dl1");
+      sgr0 = LoadTiStr("sgr0");
+      bold = LoadTiStr("bold");
+      dim = LoadTiStr("dim");
+      smul = LoadTiStr("smul");
+      rev = LoadTiStr("rev");
+      op = LoadTiStr("op");
+      bel = LoadTiStr("bel");
+
+      hpa.Load("hpa");
+      cub.Load("cub");
+      cuf.Load("cuf");
+      cuu.Load("cuu");
+      cud.Load("cud");
+      ich.Load("ich");
+      dch.Load("dch");
+      ech.Load("ech");
+      il.Load("il");
+      dl.Load("dl");
+      setaf.Load("setaf");
+      setab.Load("setab");
+
+      // Synchronized output, from the extended capability used by tmux and others: 1 begins a
+      // frame, and 2 ends it.
+      TiParamStr sync;
+      sync.Load("Sync");
+      if (sync.IsValid())
+      {
+        syncBegin = sync.Get(1);
+        syncEnd = sync.Get(2);
+      }
+
+      // Bracketed paste, from the extended capabilities used by ncurses. Few entries have them,
+      // but any terminal which understands ANSI cursor movement will at least ignore the xterm
+      // sequences if it doesn't support them.
+      pasteOn = LoadTiStr("BE");
+      pasteOff = LoadTiStr("BD");
+      pasteStart = LoadTiStr("PS");
+      pasteEnd = LoadTiStr("PE");
+      if (pasteOn.empty() && cuu1.compare(0, 2, "\x1b[") == 0)
+      {
+        pasteOn = "\x1b[?2004h";
+        pasteOff = "\x1b[?2004l";
+      }
+      if (!pasteOn.empty() && (pasteStart.empty() || pasteEnd.empty()))
+      {
+        pasteStart = "\x1b[200~";
+        pasteEnd = "\x1b[201~";
+      }
+
+      bw = HasTiFlag("bw");
+      xenl = HasTiFlag("xenl");
+      msgr = HasTiFlag("msgr");
+
+      // The size to assume if the tty can't tell us.
+      tiLines = cur_term ? TiLines() : 0;
+      tiColumns = cur_term ? TiColumns() : 0;
+      tiLines = tiLines > 0 ? tiLines : 24;
+      tiColumns = tiColumns > 0 ? tiColumns : 80;
+    }
+
+    std::string cr, nel, cub1, cuf1, cuu1, cud1, civis, cnorm, clear, smkx, rmkx, ich1, dch1, el, il1,
+                dl1, sgr0, bold, dim, smul, rev, op, bel, syncBegin, syncEnd, pasteOn, pasteOff,
+                pasteStart, pasteEnd;
+    TiParamStr hpa, cub, cuf, cuu, cud, ich, dch, ech, il, dl, setaf, setab;
+    bool bw, xenl, msgr;
+    int tiLines, tiColumns;
   };
 
+  typedef Terminal::ControlCharacters TerminalKeys;
+
   //------------------------------------------------------------------------------------------------
   /*! Machinations for putting the terminal into raw mode without turning on altscreen mode (there's
    *  no way to do one without the other using curses, sadly).
    *
    *  Three different implementations. I'm not sure if the second or third forms are useful; they're
    *  inspired by one of the many versions of 'libeditline'. They may not even compile.
+   *
+   *  Each works on the tty open as \p fd. If \p fd is -1, there is no tty, and nothing is done.
    */
   //------------------------------------------------------------------------------------------------
 #ifdef TERMINAL_USE_TCGETATTR
@@ -144,10 +515,19 @@ namespace
   struct TerminalData
   {
     struct termios data;
-    TerminalData() { tcgetattr(0, &data); }
-    void Set() { tcsetattr(0, TCSADRAIN, &data); }
+    int fd;
+    TerminalData(int _fd) : fd(_fd)
+    {
+      memset(&data, 0, sizeof(data));
+      if (fd >= 0) { tcgetattr(fd, &data); }
+    }
+    void Set() { if (fd >= 0) { tcsetattr(fd, TCSADRAIN, &data); } }
     TerminalKeys GetKeys()
     {
+      if (fd < 0)
+      {
+        return TerminalKeys();
+      }
       TerminalKeys keys;
       keys.eof = data.c_cc[VEOF];
       keys.susp = data.c_cc[VSUSP];
@@ -168,10 +548,19 @@ namespace
   struct TerminalData
   {
     struct termio	data;
-    TerminalData() { ioctl(0, TCGETA, &data); }
-    void Set() { ioctl(0, TCSETAW, &data); }
+    int fd;
+    TerminalData(int _fd) : fd(_fd)
+    {
+      memset(&data, 0, sizeof(data));
+      if (fd >= 0) { ioctl(fd, TCGETA, &data); }
+    }
+    void Set() { if (fd >= 0) { ioctl(fd, TCSETAW, &data); } }
     TerminalKeys GetKeys()
     {
+      if (fd < 0)
+      {
+        return TerminalKeys();
+      }
       TerminalKeys keys;
       keys.eof = data.c_cc[VEOF];
       keys.susp = data.c_cc[VSUSP];
@@ -194,20 +583,33 @@ namespace
     struct sgttyb	sgttyb;
     struct tchars	tchars;
     struct ltchars_ltchars;
-    TerminalData()
+    int fd;
+    TerminalData(int _fd) : fd(_fd)
     {
-      ioctl(0, TIOCGETP, &sgttyb);
-      ioctl(0, TIOCGETC, &tchars);
-      ioctl(0, TIOCGLTC, &ltchars);
+      if (fd < 0)
+      {
+        return;
+      }
+      ioctl(fd, TIOCGETP, &sgttyb);
+      ioctl(fd, TIOCGETC, &tchars);
+      ioctl(fd, TIOCGLTC, &ltchars);
     }
     void Set()
     {
-      ioctl(0, TIOCSETP, &sgttyb);
-      ioctl(0, TIOCSETC, &tchars);
-      ioctl(0, TIOCSLTC, &ltchars);
+      if (fd < 0)
+      {
+        return;
+      }
+      ioctl(fd, TIOCSETP, &sgttyb);
+      ioctl(fd, TIOCSETC, &tchars);
+      ioctl(fd, TIOCSLTC, &ltchars);
     }
     TerminalKeys GetKeys()
     {
+      if (fd < 0)
+      {
+        return TerminalKeys();
+      }
       TerminalKeys keys;
       keys.eof = tchars.t_eofc;
       keys.intr = tchars.t_intrc;
@@ -310,96 +712,100 @@ namespace
   //------------------------------------------------------------------------------------------------
   /*! A map from character sequence to key. Pass this each character as it's read from the input
    *  stream, and it'll parse the characters into keys.
+   *
+   *  The sequences are compiled into a DFA with a dense table of transitions, so each character
+   *  costs one lookup, and parsing doesn't allocate.
    */
   //------------------------------------------------------------------------------------------------
   class KeyMap
   {
   public:
-    KeyMap(const TerminalKeys &terminalKeys);
+    KeyMap();
+
+    //! Add the mappings for \p termType, which terminfo currently describes, with the user's
+    //! \p keys and the sequence which starts a paste.
+    void Load(const char *termType, const TerminalKeys &keys, const std::string &pasteStart);
 
-    //! Incrementally parse an extra character.
-    std::vector<Key> MapKey(int key);
+    //! Incrementally parse an extra character, appending any keys it completes to \p keys.
+    void MapKey(int key, std::deque<Key> &keys);
+    //! Is part of a sequence waiting for the rest of it?
+    bool Pending() const { return pendingSize != 0; }
+    //! Stop waiting for the rest of a sequence, appending what has been read as keys to \p keys.
+    void Flush(std::deque<Key> &keys);
 
     void Print(std::ostream &out);
 
   private:
+    typedef uint16_t State;
+    //! The longest sequence which can be mapped.
+    static const size_t MaxSequence = 32;
+
+    State AddState();
+    void Replay(std::deque<Key> &keys);
+    //! Map the sequence \p from to key \p to, unless it's already mapped.
+    void AddMapping(const std::string &from, Key to);
+    void AddMapping(const char *from, Key to);
     void AddMapping(char from, Key to);
-  private:
-    class Node;
-    Node *root;
-    Node *curr;
-    std::vector<Key> buffer;
+    void Print(std::ostream &out, State from, int depth);
+
+    //! The DFA. Once loaded, it's never changed, so KeyMaps for the same type of terminal and the
+    //! same keys share it: at a hundred kilobytes or so, it's the bulk of a Terminal.
+    struct Tables
+    {
+      //! next[state * 256 + c] is the state reached from state on character c, or the start
+      //! state, 0, if no sequence continues that way.
+      std::vector<State> next;
+      //! The key each state maps to, or 0 if none.
+      std::vector<Key> mapped;
+      //! Whether any sequence continues from each state. If not, its key has been read.
+      std::vector<bool> leaf;
+    };
+    boost::shared_ptr<Tables> tables;
+    //! Tables loaded so far, by terminal type and keys. Only used under the TermInfoLock.
+    static std::map<std::string, boost::shared_ptr<Tables> > loadedTables;
+
+    State state;
+    //! The characters read since the start state.
+    unsigned char pending[MaxSequence];
+    size_t pendingSize;
   };
 
-  //------------------------------------------------------------------------------------------------
-  /*! A node in KeyMap's parse tree.
-   */
-  //------------------------------------------------------------------------------------------------
-  class KeyMap::Node
+  KeyMap::KeyMap() : tables(new Tables), state(), pendingSize()
   {
-  public:
-    Node() : key() {}
-    //! Add a mapping from \p mapping to key \p mapTo.
-    void AddMapping(const char *mapping, Key mapTo)
-    {
-      if (*mapping)
-      {
-        Node *&slot = next[*mapping];
-        if (!slot)
-        {
-          slot = new Node;
-        }
-        slot->AddMapping(mapping + 1, mapTo);
-      }
-      else if (!key)
-      {
-        key = mapTo;
-      }
-    }
-    //! Is this a terminal node (ie, no descendents)?
-    bool IsTerminal() const { return next.empty(); }
-    //! Get the key corresponding to this node, or 0 if none.
-    Key GetKey() const { return key; }
-    //! Given a character, find the corresponding descendent node.
-    Node *Map(int key) const
-    {
-      Next::const_iterator it = next.find(key);
-      if (it != next.end())
-      {
-        return it->second;
-      }
-      return 0;
-    }
+    // The start state.
+    AddState();
+  }
 
-    //! Debug printout of the map.
-    void Print(std::ostream &out, int depth)
-    {
-      std::string indent(depth * 2, ' ');
-      for (Next::iterator it = next.begin(); it != next.end(); ++it)
-      {
-        out << indent << it->first << " ->";
-        if (it->second->GetKey())
-        {
-          out << " " << it->second->GetKey();
-        }
-        out << "\n";
-        it->second->Print(out, depth + 1);
-      }
-    }
-  private:
-    int key;
-    typedef std::map<int, Node*> Next;
-    Next next;
-  };
+  std::map<std::string, boost::shared_ptr<KeyMap::Tables> > KeyMap::loadedTables;
 
   //------------------------------------------------------------------------------------------------
-  /*! Build the key map. Mappings from characters to keys will be read from terminfo.
+  /*! Build the key map. Mappings from characters to keys will be read from terminfo, unless a key
+   *  map has already been built for the same terminal type and keys, in which case it's shared.
    *
    *  \param keys  The user's current EOF (^D), suspend (^Z), interrupt (^C) and quit (^\) keys.
    */
   //------------------------------------------------------------------------------------------------
-  KeyMap::KeyMap(const TerminalKeys &keys) : root(new Node), curr(0)
+  void KeyMap::Load(const char *termType, const TerminalKeys &keys, const std::string &pasteStart)
   {
+    TermInfoLock lock;
+    std::string name = termType ? termType : getenv("TERM") ? getenv("TERM") : "";
+    const char keyChars[] = { char(keys.eof), char(keys.susp), char(keys.intr), char(keys.quit), 0 };
+    name += '\0';
+    name += keyChars;
+    name += '\0';
+    name += pasteStart;
+    // Start afresh: the tables in use may be shared, and are never changed once loaded.
+    state = 0;
+    pendingSize = 0;
+    boost::shared_ptr<Tables> &loaded = loadedTables[name];
+    if (loaded)
+    {
+      tables = loaded;
+      return;
+    }
+    tables.reset(new Tables);
+    AddState();
+
     AddMapping(keys.eof, Keys::Eof);
     AddMapping(keys.susp, Keys::Suspend);
     AddMapping(keys.intr, Keys::Interrupt);
@@ -412,7 +818,7 @@ namespace
       const char *str = tigetstr(specialKeys[n].capname);
       if (IsValidTiStr(str))
       {
-        root->AddMapping(str, specialKeys[n].key);
+        AddMapping(str, specialKeys[n].key);
       }
     }
 
@@ -422,7 +828,7 @@ namespace
       const char *str = tigetstr(ignoredKeys[n]);
       if (IsValidTiStr(str))
       {
-        root->AddMapping(str, Keys::Ignored);
+        AddMapping(str, Keys::Ignored);
       }
     }
 
@@ -431,84 +837,168 @@ namespace
     // a conflict, the real ones win.
     for (int n = 0; n < arraysize(backupBindings); ++n)
     {
-      root->AddMapping(backupBindings[n].seq, backupBindings[n].key);
+      AddMapping(backupBindings[n].seq, backupBindings[n].key);
     }
 #undef arraysize
+
+    if (!pasteStart.empty())
+    {
+      AddMapping(pasteStart, Keys::Paste);
+    }
+    loaded = tables;
+  }
+
+  //! Add a state with no transitions out of it.
+  KeyMap::State KeyMap::AddState()
+  {
+    const State added = tables->mapped.size();
+    tables->next.resize(tables->next.size() + 256, 0);
+    tables->mapped.push_back(0);
+    tables->leaf.push_back(true);
+    return added;
+  }
+
+  void KeyMap::AddMapping(const char *from, Key to)
+  {
+    if (!*from || strlen(from) > MaxSequence)
+    {
+      return;
+    }
+    State at = 0;
+    for (/**/; *from; ++from)
+    {
+      const size_t transition = at * 256 + static_cast<unsigned char>(*from);
+      if (!tables->next[transition])
+      {
+        const State added = AddState();
+        tables->next[transition] = added;
+        tables->leaf[at] = false;
+      }
+      at = tables->next[transition];
+    }
+    if (!tables->mapped[at])
+    {
+      tables->mapped[at] = to;
+    }
   }
 
   void KeyMap::AddMapping(char from, Key to)
   {
     char str[2] = {from, 0};
-    root->AddMapping(str, to);
+    AddMapping(str, to);
+  }
+
+  void KeyMap::AddMapping(const std::string &from, Key to)
+  {
+    AddMapping(from.c_str(), to);
   }
 
   void KeyMap::Print(std::ostream &out)
   {
-    root->Print(out, 0);
+    Print(out, 0, 0);
   }
 
-  std::vector<Key> KeyMap::MapKey(int key)
+  //! Debug printout of the sequences continuing from \p from.
+  void KeyMap::Print(std::ostream &out, State from, int depth)
   {
-    std::vector<Key> keys;
+    std::string indent(depth * 2, ' ');
+    for (int c = 0; c < 256; ++c)
+    {
+      if (State to = tables->next[from * 256 + c])
+      {
+        out << indent << c << " ->";
+        if (tables->mapped[to])
+        {
+          out << " " << tables->mapped[to];
+        }
+        out << "\n";
+        Print(out, to, depth + 1);
+      }
+    }
+  }
 
-    // TODO: if it's been more than a second or so since the last key,
-    // and curr->GetKey() is set, then we might want to return that. As
-    // things stand, we don't return Escape until another key gets pressed.
+  void KeyMap::MapKey(int key, std::deque<Key> &keys)
+  {
+    if (const State to = tables->next[state * 256 + (key & 0xff)])
+    {
+      pending[pendingSize++] = key;
+      state = to;
+      if (tables->leaf[state])
+      {
+        // Key sequence resolved.
+        if (tables->mapped[state])
+        {
+          keys.push_back(tables->mapped[state]);
+        }
+        else
+        {
+          // Unbound, so the editor rings the bell.
+          keys.push_back(Keys::Ignored);
+        }
+        state = 0;
+        pendingSize = 0;
+      }
+      return;
+    }
 
-    if (!curr)
+    if (!pendingSize)
     {
-      curr = root;
+      // By far the most common case: a character which doesn't start any sequence.
+      keys.push_back(key);
+      return;
     }
 
-    buffer.push_back(key);
-    curr = curr->Map(key);
+    // Key sequence can't resolve.
+    Replay(keys);
+    MapKey(key, keys);
+  }
 
-    if (!curr)
+  //! Interpret the first pending character as a key by itself, and parse the rest again.
+  void KeyMap::Replay(std::deque<Key> &keys)
+  {
+    unsigned char rest[MaxSequence];
+    const size_t restSize = pendingSize - 1;
+    memcpy(rest, pending + 1, restSize);
+    keys.push_back(pending[0]);
+    state = 0;
+    pendingSize = 0;
+    for (size_t n = 0; n < restSize; ++n)
     {
-      // Key sequence can't resolve. Interpret first character as a key
-      // by itself and try again. Not the fastest way to do this, but it'll do.
-      // As a degenerate case, we also get here if an unbound key is pressed.
-      keys.push_back(buffer[0]);
-      std::vector<Key> oldBuffer;
-      oldBuffer.swap(buffer);
-      for (int n = 1; n < oldBuffer.size(); ++n)
-      {
-        std::vector<Key> results = MapKey(oldBuffer[n]);
-        keys.insert(keys.end(), results.begin(), results.end());
-      }
+      MapKey(rest[n], keys);
     }
-    else if (curr->IsTerminal())
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! Give up on the sequence being read. If what has been read so far is a key in its own right,
+   *  that's the key; otherwise, its characters are keys by themselves.
+   */
+  //------------------------------------------------------------------------------------------------
+  void KeyMap::Flush(std::deque<Key> &keys)
+  {
+    while (pendingSize)
     {
-      // Key sequence resolved.
-      Key mapped = curr->GetKey();
-      if (mapped)
+      if (tables->mapped[state])
       {
-        keys.push_back(mapped);
+        keys.push_back(tables->mapped[state]);
+        state = 0;
+        pendingSize = 0;
       }
       else
       {
-        TiBell();
+        Replay(keys);
       }
-      curr = 0;
-      buffer.clear();
-    }
-    else
-    {
-      // Key sequence not yet resolved.
     }
-
-    //std::cerr << keys.size() << " keys" << std::endl;
-
-    return keys;
   }
 }
 
 
 //--------------------------------------------------------------------------------------------------
-/*! Terminal attribute.
+/*! Terminal attributes.
  */
 //--------------------------------------------------------------------------------------------------
-class Redline::TerminalAttribute {} Redline::Attributes::Normal, Redline::Attributes::Error;
+TerminalAttribute Redline::Attributes::Normal;
+TerminalAttribute Redline::Attributes::Error(TerminalAttribute::Bold, TerminalAttribute::Red);
+TerminalAttribute Redline::Attributes::Hint(TerminalAttribute::Dim);
 
 //--------------------------------------------------------------------------------------------------
 /*! Decorated text implementation.
@@ -516,19 +1006,278 @@ class Redline::TerminalAttribute {} Redline::Attributes::Normal, Redline::Attrib
 //--------------------------------------------------------------------------------------------------
 class DecoratedText::Internals
 {
-  struct DecoratedChar
+public:
+  //! The attribute of a run of characters, from \c start up to the start of the next span.
+  struct Span
   {
-    DecoratedChar(const TerminalAttribute &, char _c) : c(_c) {}
-    char c;
+    Span(int _start, const TerminalAttribute &_attribute) : start(_start), attribute(_attribute) {}
+    int start;
+    TerminalAttribute attribute;
 
-    bool operator==(const DecoratedChar &o) const { return c == o.c; }
-    bool operator!=(const DecoratedChar &o) const { return !operator==(o); }
+    bool operator==(const Span &o) const { return start == o.start && attribute == o.attribute; }
   };
-public:
-  Internals() : lines(1) {}
-
-  typedef std::vector<DecoratedChar> Line;
-  std::vector<Line> lines;
+
+  //------------------------------------------------------------------------------------------------
+  /*! One row of text. The characters are stored contiguously, and their attributes as a list of
+   *  spans, so that a row in a single attribute costs one span however long it is. Adjacent spans
+   *  always have different attributes.
+   */
+  //------------------------------------------------------------------------------------------------
+  class Line
+  {
+  public:
+    int size() const { return chars.size(); }
+    bool empty() const { return chars.empty(); }
+    const char *Chars() const { return chars.data(); }
+    char Char(int col) const { return chars[col]; }
+    const std::vector<Span> &Spans() const { return spans; }
+
+    bool operator==(const Line &o) const { return chars == o.chars && spans == o.spans; }
+    bool operator!=(const Line &o) const { return !operator==(o); }
+
+    //! Get the attribute of the character at \p col.
+    const TerminalAttribute &AttributeAt(int col) const
+    {
+      std::vector<Span>::const_iterator it =
+        std::upper_bound(spans.begin(), spans.end(), col, StartsAfter());
+      return (--it)->attribute;
+    }
+
+    void Append(const TerminalAttribute &attribute, char c)
+    {
+      if (spans.empty() || spans.back().attribute != attribute)
+      {
+        spans.push_back(Span(size(), attribute));
+      }
+      chars += c;
+    }
+
+    //! Set the character at \p col, padding the line with spaces if necessary.
+    void Set(int col, const TerminalAttribute &attribute, char c)
+    {
+      if (col >= size())
+      {
+        Resize(col);
+        Append(attribute, c);
+        return;
+      }
+      chars[col] = c;
+      if (AttributeAt(col) != attribute)
+      {
+        SetAttribute(col, col + 1, attribute);
+      }
+    }
+
+    //! Insert \p count plain spaces at \p col, which must be no more than size().
+    void Insert(int col, int count)
+    {
+      chars.insert(col, count, ' ');
+      for (std::vector<Span>::iterator it = spans.begin(); it != spans.end(); ++it)
+      {
+        if (it->start >= col) { it->start += count; }
+      }
+      SetAttribute(col, col + count, Attributes::Normal);
+    }
+
+    //! Remove \p count characters starting at \p col.
+    void Erase(int col, int count)
+    {
+      count = std::min(count, size() - col);
+      chars.erase(col, count);
+      for (std::vector<Span>::iterator it = spans.begin(); it != spans.end(); ++it)
+      {
+        it->start = it->start >= col + count ? it->start - count : std::min(it->start, col);
+      }
+      Normalize();
+    }
+
+    //! Truncate the line, or pad it with plain spaces.
+    void Resize(int newSize)
+    {
+      if (newSize > size())
+      {
+        if (spans.empty() || spans.back().attribute != Attributes::Normal)
+        {
+          spans.push_back(Span(size(), Attributes::Normal));
+        }
+        chars.resize(newSize, ' ');
+      }
+      else if (newSize < size())
+      {
+        chars.resize(newSize);
+        Normalize();
+      }
+    }
+
+    //! Copy the characters in [\p begin, \p end) of \p o.
+    void AssignPart(const Line &o, int begin, int end)
+    {
+      chars.assign(o.chars, begin, end - begin);
+      spans.clear();
+      for (size_t n = 0; n < o.spans.size() && o.spans[n].start < end; ++n)
+      {
+        const int spanEnd = n + 1 < o.spans.size() ? o.spans[n + 1].start : o.size();
+        if (spanEnd > begin)
+        {
+          spans.push_back(Span(std::max(o.spans[n].start - begin, 0), o.spans[n].attribute));
+        }
+      }
+    }
+
+    void Assign(const Line &o)
+    {
+      chars.assign(o.chars);
+      spans = o.spans;
+    }
+
+    void Clear()
+    {
+      chars.clear();
+      spans.clear();
+    }
+
+    void Reserve(int n) { chars.reserve(n); }
+
+    void swap(Line &o)
+    {
+      chars.swap(o.chars);
+      spans.swap(o.spans);
+    }
+
+  private:
+    struct StartsAfter
+    {
+      bool operator()(int col, const Span &span) const { return col < span.start; }
+    };
+
+    //! Give the characters in [\p begin, \p end) the attribute \p attribute.
+    void SetAttribute(int begin, int end, const TerminalAttribute &attribute)
+    {
+      const TerminalAttribute after = end < size() ? AttributeAt(end) : attribute;
+      std::vector<Span>::iterator first = spans.begin();
+      while (first != spans.end() && first->start < begin) { ++first; }
+      std::vector<Span>::iterator last = first;
+      while (last != spans.end() && last->start <= end) { ++last; }
+      std::vector<Span>::iterator it = spans.insert(spans.erase(first, last), Span(begin, attribute));
+      if (end < size())
+      {
+        spans.insert(it + 1, Span(end, after));
+      }
+      Normalize();
+    }
+
+    //! Drop spans which are empty or past the end, and merge spans with the same attribute.
+    void Normalize()
+    {
+      size_t out = 0;
+      for (size_t n = 0; n < spans.size() && spans[n].start < size(); ++n)
+      {
+        // Of several spans starting at the same place, the last one wins.
+        while (out && spans[out - 1].start >= spans[n].start) { --out; }
+        if (!out || spans[out - 1].attribute != spans[n].attribute)
+        {
+          spans[out++] = spans[n];
+        }
+      }
+      spans.erase(spans.begin() + out, spans.end());
+    }
+
+    std::string chars;
+    std::vector<Span> spans;
+  };
+
+  Internals() : lines(1) {}
+
+  std::vector<Line> lines;
+
+  //! Whether line \p line is the same as line \p otherLine of \p other. Lines of different
+  //! lengths are told apart straight away, and the rest by comparing their characters with memcmp.
+  bool SameLine(size_t line, const Internals &other, size_t otherLine) const
+  {
+    return lines[line] == other.lines[otherLine];
+  }
+
+  //! Storage of removed lines, kept so that the next frame can reuse it.
+  std::vector<Line> spare;
+
+  //! Add an empty line at the end, reusing old storage if there is any.
+  void AddLine()
+  {
+    lines.push_back(Line());
+    if (!spare.empty())
+    {
+      lines.back().swap(spare.back());
+      spare.pop_back();
+    }
+    else
+    {
+      // Avoid too many reallocations.
+      lines.back().Reserve(80);
+    }
+  }
+
+  //! Remove lines from the end until there are \p size, keeping their storage.
+  void RemoveLines(size_t size)
+  {
+    while (lines.size() > size)
+    {
+      lines.back().Clear();
+      spare.push_back(Line());
+      spare.back().swap(lines.back());
+      lines.pop_back();
+    }
+  }
+
+  //! Remove the lines in [\p begin, \p end), keeping their storage.
+  void RemoveLines(size_t begin, size_t end)
+  {
+    // Swap the removed lines past the ones after them, to the end.
+    for (size_t line = end; line < lines.size(); ++line)
+    {
+      lines[line - (end - begin)].swap(lines[line]);
+    }
+    RemoveLines(lines.size() - (end - begin));
+  }
+
+  //! Insert \p count empty lines before line \p at, reusing old storage if there is any.
+  void InsertLines(size_t at, size_t count)
+  {
+    for (size_t n = 0; n < count; ++n)
+    {
+      AddLine();
+    }
+    for (size_t line = lines.size(); line-- > at + count; /**/)
+    {
+      lines[line].swap(lines[line - count]);
+    }
+  }
+
+  //! Remove all of the text, without freeing any storage.
+  void Clear()
+  {
+    RemoveLines(0);
+    AddLine();
+  }
+
+  //! Copy \p other into the storage we already have.
+  void Assign(const Internals &other)
+  {
+    RemoveLines(other.lines.size());
+    while (lines.size() < other.lines.size())
+    {
+      AddLine();
+    }
+    for (size_t line = 0; line < lines.size(); ++line)
+    {
+      lines[line].Assign(other.lines[line]);
+    }
+  }
+
+  void Swap(Internals &other)
+  {
+    lines.swap(other.lines);
+    spare.swap(other.spare);
+  }
 
   void Add(const TerminalAttribute &attribute, const std::string &text)
   {
@@ -536,59 +1285,110 @@ public:
     {
       if (*it == '\n')
       {
-        lines.push_back(Line());
-        // Avoid too many reallocations.
-        lines.back().reserve(80);
+        AddLine();
       }
       else
       {
-        lines.back().push_back(DecoratedChar(attribute, *it));
+        lines.back().Append(attribute, *it);
       }
     }
   }
 
+  //! Scratch space for Prepare: where each line wraps, and how many times.
+  //@{
+  std::vector<int> wrapBreaks;
+  std::vector<int> wrapCounts;
+  //@}
+
+  //! Pad a row which is continued on the next one, and add a trailing backslash.
+  static void AddContinuation(Line &row, int maxCols)
+  {
+    row.Resize(maxCols - 1);
+    row.Append(Attributes::Normal, '\\');
+  }
+
   void Prepare(int maxLines, int maxCols, int &cursorLine, int &cursorCol)
   {
     // TODO: Convert special characters to displayed versions.
     //  eg. "\x05\0xC2" -> "[^E][M-B]"
 
-    // Wrap lines which are too long.
-    // Warning: this loop is a little subtle; lines gets bigger as we progress.
+    // Wrap lines which are too long. First find where each line breaks, and move the cursor with
+    // the text.
+    wrapBreaks.clear();
+    wrapCounts.assign(lines.size(), 0);
+    int rows = 0;
     for (size_t line = 0; line < lines.size(); ++line)
     {
-      // Note, if size == maxCols, we still wrap, since we need an extra column for the cursor.
-      // If the cursor is after the last column, it goes on the extra (empty) line we create.
-      if (lines[line].size() >= maxCols)
+      const Line &l = lines[line];
+      int row = rows;
+      // Note, if the rest is maxCols wide, we still wrap, since we need an extra column for the
+      // cursor. If the cursor is after the last column, it goes on the extra (empty) row.
+      for (int start = 0; l.size() - start >= maxCols; /**/)
       {
         int newWidth = maxCols - 1;
 
         // Prefer to wrap at a space.
         for (int pos = newWidth - 1; pos > newWidth - 16 && pos > maxCols / 2; --pos)
         {
-          if (lines[line][pos].c == ' ')
+          if (l.Char(start + pos) == ' ')
           {
             newWidth = pos + 1;
             break;
           }
         }
 
-        lines.insert(lines.begin() + line + 1, Line(lines[line].begin() + newWidth, lines[line].end()));
-        lines[line].resize(newWidth, DecoratedChar(Attributes::Normal, ' '));
-
-        // Add a trailing backslash to continued lines.
-        lines[line].resize(maxCols, DecoratedChar(Attributes::Normal, ' '));
-        lines[line][maxCols - 1] = DecoratedChar(Attributes::Normal, '\\');
+        start += newWidth;
+        wrapBreaks.push_back(start);
+        ++wrapCounts[line];
 
         // Move the cursor with the text.
-        if (cursorLine == line && cursorCol >= newWidth)
+        if (cursorLine == row && cursorCol >= newWidth)
         {
           ++cursorLine;
           cursorCol -= newWidth;
         }
-        else if (cursorLine > line)
+        else if (cursorLine > row)
         {
           ++cursorLine;
         }
+        ++row;
+      }
+      rows += wrapCounts[line] + 1;
+    }
+
+    if (rows != static_cast<int>(lines.size()))
+    {
+      // Then move the pieces into place, starting from the end. Every line moves down, so the rows
+      // it moves into are free by the time we get to it.
+      const int oldRows = lines.size();
+      while (static_cast<int>(lines.size()) < rows)
+      {
+        AddLine();
+      }
+      size_t breaks = wrapBreaks.size();
+      for (int line = oldRows - 1, row = rows; line >= 0; --line)
+      {
+        row -= wrapCounts[line] + 1;
+        for (int piece = wrapCounts[line]; piece > 0; --piece)
+        {
+          const int end = piece < wrapCounts[line] ? wrapBreaks[breaks - wrapCounts[line] + piece]
+                                                   : lines[line].size();
+          lines[row + piece].AssignPart(lines[line], wrapBreaks[breaks - wrapCounts[line] + piece - 1], end);
+          if (piece < wrapCounts[line])
+          {
+            AddContinuation(lines[row + piece], maxCols);
+          }
+        }
+        if (wrapCounts[line])
+        {
+          lines[line].Resize(wrapBreaks[breaks - wrapCounts[line]]);
+          AddContinuation(lines[line], maxCols);
+          breaks -= wrapCounts[line];
+        }
+        if (row != line)
+        {
+          lines[row].swap(lines[line]);
+        }
       }
     }
 
@@ -596,8 +1396,8 @@ public:
     if (lines.size() > maxLines)
     {
       int first = std::max(0, std::min<int>(cursorLine - maxLines / 2, lines.size() - maxLines));
-      lines.erase(lines.begin() + first + maxLines, lines.end());
-      lines.erase(lines.begin(), lines.begin() + first);
+      RemoveLines(first + maxLines);
+      RemoveLines(0, first);
       cursorLine -= first;
     }
   }
@@ -609,6 +1409,10 @@ void DecoratedText::Add(const TerminalAttribute &attribute, const std::string &t
 {
   internals->Add(attribute, text);
 }
+void DecoratedText::Clear()
+{
+  internals->Clear();
+}
 
 
 //--------------------------------------------------------------------------------------------------
@@ -618,53 +1422,148 @@ void DecoratedText::Add(const TerminalAttribute &attribute, const std::string &t
 class Terminal::Internals
 {
 public:
-  Internals();
+  Internals(int inFd, int outFd, const char *termType, int lines, int columns,
+            const Writer &writer);
   ~Internals();
 
-  void DoWaitForKey(bool wait);
+  //! Wait up to timeoutMs, if it isn't negative, when wait is set.
+  void DoWaitForKey(bool wait, long timeoutMs = -1);
 
   void Redisplay();
   void Commit(bool addNewline);
+  void PrintAbove(const std::string &printed);
+  bool ClearToEndOfLine();
 
-  void WriteChar(char ch);
-  void Flush() { fflush(stdout); }
+  bool ProbeSync();
+
+  void WriteChar(char ch, const TerminalAttribute &attribute = Attributes::Normal);
+  void SetAttribute(const TerminalAttribute &to);
+  bool Emit(const std::string &cap);
+  void Flush();
 
   int GetCursorCol();
 
-  void UpdateSize() { GetTerminalSize(columns, lines); }
+  //! Refresh the cached terminal size, if it might have changed.
+  void UpdateSize()
+  {
+    if (Embedded())
+    {
+      return;
+    }
+    if (watchResize)
+    {
+      if (!terminalResized)
+      {
+        return;
+      }
+      terminalResized = 0;
+    }
+    const int oldLines = lines, oldColumns = columns;
+    if (!GetTerminalSize(outFd, columns, lines))
+    {
+      columns = caps.tiColumns;
+      lines = caps.tiLines;
+    }
+    if (recording && (lines != oldLines || columns != oldColumns))
+    {
+      recording->AddResize(lines, columns);
+    }
+  }
   int GetColumns() { return columns; }
   int GetLines() { return lines; }
 
-  bool CursorLeft(int by);
-  bool CursorRight(int by);
-  bool CursorUp(int by);
-  bool CursorDown(int by);
+  //! Cursor movement.
+  //@{
+  enum Move
+  {
+    MoveNone, MoveReprint, MoveHpa,
+    MoveCub, MoveCub1, MoveCuf, MoveCuf1, MoveCuu, MoveCuu1, MoveCud, MoveCud1, MoveBackspaceWrap
+  };
+  char DisplayedChar(int line, int col);
+  const TerminalAttribute &DisplayedAttribute(int line, int col);
+  int PlanLeft(int by, Move &how);
+  int PlanRight(int line, int from, int to, const TerminalAttribute &drawing, Move &how);
+  int PlanColumn(int line, int from, int to, const TerminalAttribute &drawing, bool &cr, Move &how);
+  int PlanVertical(int by, Move &how);
+  void EmitMove(Move how, int line, int from, int to);
+  bool MoveVertical(int by);
   bool CursorTo(int line, int col);
+  //@}
+
+  //! Line editing.
+  //@{
+  enum Edit { EditKeep, EditWrite, EditInsert, EditDelete, EditClear };
+  //! Edits which are states of the alignment in UpdateLine. EditClear only ends a line.
+  static const int NumEditStates = EditClear;
+  void AddEdit(Edit edit, int count);
+  int InsertCost(int by);
+  int DeleteCost(int by);
+  int ClearCost(int by);
+  void InsertChars(int line, int col, int by);
+  void DeleteChars(int line, int col, int by);
+  void ClearToEnd(int line, int col, int by);
+  bool UpdateLine(int line, const DecoratedText::Internals::Line &to);
+  //@}
+
+  //! Row editing.
+  //@{
+  void AppendRow();
+  void ShiftRows(const DecoratedText::Internals &newText);
+  //@}
 
-  void SetText(const DecoratedText::Internals &text, int cursorLine, int cursorCol);
+  void SetText(DecoratedText::Internals &text, int cursorLine, int cursorCol);
 
 public:
+  TerminalCaps caps;
   TerminalData oldTerminalData;
   TerminalData newTerminalData;
   int suspended;
 
+  //! The tty, or -1 for an embedded terminal, whose output goes to writer instead.
+  //@{
+  int inFd, outFd;
+  Writer writer;
+  bool Embedded() const { return !writer.empty(); }
+  //@}
+  //! Whether the cached size is kept up to date by SIGWINCH. Only one Terminal can be, and only if
+  //! its tty is the process's controlling terminal; others ask the tty for the size every frame.
+  bool watchResize;
+  //! The terminal type, as given or from $TERM.
+  std::string termType;
+  //! Where the input is being recorded, if anywhere.
+  Recording *recording;
+  //! Scratch space for passing input read from the tty to recording.
+  std::string recorded;
+
   void Enable()
   {
     if (--suspended == 0)
     {
-      fflush(stdout);
+      if (watchResize)
+      {
+        // We don't get SIGWINCH while we're not in the foreground.
+        terminalResized = 1;
+      }
+      if (outFd == STDOUT_FILENO)
+      {
+        fflush(stdout);
+      }
       newTerminalData.Set();
       // Turn on 'keypad-transmit', AKA 'send me the key sequences you
       // said you would' mode. Otherwise arrow keys come in garbled.
-      TiStr("smkx");
+      Emit(caps.smkx);
+      // Have pastes marked, so they can be told apart from typing.
+      Emit(caps.pasteOn);
+      Flush();
     }
   }
   void Disable()
   {
     if (suspended++ == 0)
     {
-      TiStr("rmkx");
-      fflush(stdout);
+      Emit(caps.pasteOff);
+      Emit(caps.rmkx);
+      Flush();
       oldTerminalData.Set();
     }
   }
@@ -672,42 +1571,180 @@ public:
   //! Input handling.
   //@{
   KeyMap keyMap;
+  //! The control characters the key map was loaded with.
+  TerminalKeys controlCharacters;
   std::deque<Key> buffer;
+  //! Input read from the terminal, still to be mapped to keys.
+  InputBuffer input;
   bool meta;
+  void TranslateKeys(size_t from);
+
+  //! How long to wait for the rest of an escape sequence, or for the key after Esc, in
+  //! milliseconds; 0 to wait indefinitely. When input was last read.
+  //@{
+  int escapeTimeout;
+  timeval lastInput;
+  long EscapeTimeLeft();
+  //@}
+
+  //! Bracketed paste. The text of each Keys::Paste in buffer waits in pastes; GetKey() moves it
+  //! to paste when it returns the key.
+  //@{
+  bool pasting;
+  std::deque<std::string> pastes;
+  std::string paste;
+  void ReadPaste();
+  //@}
   int interruptFd[2];
+
+  //! Waiting for input, directly or through an application's event loop.
+  //@{
+  enum Ready { ReadyInput = 1, ReadyInterrupt = 2, ReadyApplication = 4 };
+  EventLoop *eventLoop;
+  unsigned ready;
+  unsigned WaitForInput(long timeoutMs);
+  void OnReady(int fd, unsigned events);
+  void SetEventLoop(EventLoop *loop);
+  //@}
   //@}
 
   //! Output handling.
   //@{
+  //! Output assembled for the current frame, written by Flush() in one go.
+  std::string output;
+  //! Statistics for the frame last written, and for the one being assembled.
+  FrameStats frameStats, nextFrameStats;
   DecoratedText::Internals text;
+  //! The frame being prepared. Swapped with text once it's displayed.
+  DecoratedText::Internals back;
   int lines, columns;
   int cursorLine, cursorCol;
+  //! The attribute the terminal is currently set to draw in.
+  TerminalAttribute attribute;
+
+  //! Scratch space for UpdateLine, kept to avoid reallocating it for every line.
+  //@{
+  std::vector<int> editCost[NumEditStates];
+  std::vector<unsigned char> editPrev[NumEditStates];
+  std::vector<std::pair<Edit, int> > editScript;
+  std::vector<const TerminalAttribute *> fromAttributes, toAttributes;
+  //@}
   //@}
 
-  bool renderDebug;
-  int renderDebugPos;
+  //! Debug overlay highlighting repainted characters. The Konami code toggles it.
+  //@{
+  bool renderOverlay;
+  int renderOverlayFrame;
+  int renderOverlayCodePos;
+  void Repaint(char ch, const TerminalAttribute &attribute);
+  //@}
 };
 
-Terminal::Internals::Internals() :
-  oldTerminalData(), newTerminalData(oldTerminalData), suspended(1),
-  keyMap(oldTerminalData.GetKeys()), meta(false),
-  text(), cursorLine(), cursorCol(-1), renderDebug(false), renderDebugPos(0)
+Terminal::Internals::Internals(int _inFd, int _outFd, const char *_termType, int _lines,
+                               int _columns, const Writer &_writer) :
+  oldTerminalData(_inFd), newTerminalData(oldTerminalData), suspended(1),
+  inFd(_inFd), outFd(_outFd), writer(_writer), watchResize(false),
+  termType(_termType ? _termType : getenv("TERM") ? getenv("TERM") : ""), recording(), recorded(),
+  keyMap(), controlCharacters(oldTerminalData.GetKeys()), meta(false), escapeTimeout(1000), pasting(false),
+  eventLoop(), ready(),
+  text(), lines(_lines), columns(_columns), cursorLine(), cursorCol(-1), attribute(), renderOverlay(false),
+  renderOverlayFrame(), renderOverlayCodePos(0)
 {
+  {
+    TermInfoScope terminfo(_termType);
+    caps.Load();
+    keyMap.Load(_termType, controlCharacters, caps.pasteStart);
+  }
+  // Like curses, let the user choose how long to wait after Esc.
+  if (const char *delay = getenv("ESCDELAY"))
+  {
+    escapeTimeout = std::max(atoi(delay), 0);
+  }
+  gettimeofday(&lastInput, 0);
   newTerminalData.SetRaw();
   Enable();
 
-  //keyMap.Print(std::cerr);
-  UpdateSize();
+  if (Embedded())
+  {
+    // The application does all of the I/O.
+    interruptFd[0] = interruptFd[1] = -1;
+    return;
+  }
+
+  // Few terminfo entries describe synchronized output yet, so ask the terminal itself.
+  if (caps.syncBegin.empty() && isatty(inFd) && isatty(outFd) && ProbeSync())
+  {
+    caps.syncBegin = "\x1b[?2026h";
+    caps.syncEnd = "\x1b[?2026l";
+  }
 
+  //keyMap.Print(std::cerr);
   pipe(interruptFd);
+
+  // SIGWINCH only comes for the controlling terminal.
+  const pid_t session = tcgetsid(inFd);
+  watchResize = session != -1 && session == getsid(0) && resizeWakeFd < 0;
+  if (watchResize)
+  {
+    resizeWakeFd = interruptFd[1];
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = OnResize;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &action, &previousResizeAction);
+    terminalResized = 1;
+  }
+  UpdateSize();
 }
 
 Terminal::Internals::~Internals()
 {
+  if (!Embedded())
+  {
+    SetEventLoop(0);
+    if (watchResize)
+    {
+      sigaction(SIGWINCH, &previousResizeAction, 0);
+      resizeWakeFd = -1;
+    }
+  }
   Disable();
+  if (!Embedded())
+  {
+    close(interruptFd[0]);
+    close(interruptFd[1]);
+  }
+}
+
+Terminal::Terminal() :
+  internals(new Internals(STDIN_FILENO, STDOUT_FILENO, 0, 0, 0, Writer()))
+{
 }
 
-Terminal::Terminal() : internals((InitTerminal(), new Internals))
+//--------------------------------------------------------------------------------------------------
+/*! Use the tty open as \p inFd and \p outFd, which is of type \p termType, or $TERM if that's
+ *  empty. Any number of these can be in use at once, each with its own capabilities: on ptys, say.
+ *  Only one Terminal, on the process's controlling terminal, hears about changes of size through
+ *  SIGWINCH; the others pick them up as they draw each frame.
+ */
+//--------------------------------------------------------------------------------------------------
+Terminal::Terminal(int inFd, int outFd, const std::string &termType) :
+  internals(new Internals(inFd, outFd, termType.empty() ? 0 : termType.c_str(), 0, 0, Writer()))
+{
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Create an embedded terminal, which does no I/O of its own, for an application which does the
+ *  I/O itself: over a socket, say. The application passes in what is read from the terminal with
+ *  Feed() and tells it the terminal's size with Resize(). What is to be written to the terminal is
+ *  passed to \p writer as each frame is completed; line feeds are written as "\r\n", as a tty would.
+ *  Nothing blocks, and nothing global is touched: the capabilities of \p termType are loaded
+ *  from terminfo here, and kept.
+ */
+//--------------------------------------------------------------------------------------------------
+Terminal::Terminal(const std::string &termType, int rows, int columns, const Writer &writer) :
+  internals(new Internals(-1, -1, termType.c_str(), rows, columns, writer))
 {
 }
 
@@ -736,76 +1773,274 @@ SuspendTerminal::~SuspendTerminal()
   delete internals;
 }
 
-void Terminal::Internals::DoWaitForKey(bool wait)
+void Terminal::Internals::DoWaitForKey(bool wait, long timeoutMs)
 {
+  timeval start;
+  if (timeoutMs >= 0)
+  {
+    gettimeofday(&start, 0);
+  }
+
   // Read characters and map them to keys.
   while (buffer.empty())
   {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(0, &fds);
-    FD_SET(interruptFd[0], &fds);
-
-    timeval t = {0};
-    while (select(interruptFd[0]+1, &fds, 0, 0, wait ? 0 : &t) == -1) {}
-
-    if (FD_ISSET(interruptFd[0], &fds))
-    {
-      int c = 0;
-      read(interruptFd[0], &c, 1);
-      buffer.push_back(Keys::AsyncInterrupted);
-      break;
-    }
-
-    if (!FD_ISSET(0, &fds) && !wait)
-    {
-      break;
-    }
-
-    // Read characters until we get a complete key.
-    unsigned char c = 0;
-    fflush(stdout);
-    while (read(1, &c, 1) < 1 && errno == EINTR) {}
-    int ch = c;
-    //std::cerr << "Char " << ch << std::endl;
-
-    std::vector<Key> keys = keyMap.MapKey(ch);
-    buffer.insert(buffer.begin(), keys.begin(), keys.end());
-
-    // Translate Esc, Key -> Alt + Key.
-    for (std::deque<Key>::iterator it = buffer.begin(); it != buffer.end(); /*increment in loop*/)
+    if (input.Empty())
     {
-      if (meta)
+      // If we're part way through an escape sequence, or have had an Esc, and nothing more comes
+      // in time, what we have is all there is.
+      const long escapeLeft = EscapeTimeLeft();
+      if (escapeLeft == 0)
       {
-        *it += Keys::Alt;
-        meta = false;
-        ++it;
+        const size_t from = buffer.size();
+        keyMap.Flush(buffer);
+        TranslateKeys(from);
+        if (meta)
+        {
+          meta = false;
+          buffer.push_back(Keys::Escape);
+        }
+        continue;
       }
-      else if (*it == 27)
+
+      if (Embedded())
       {
-        meta = true;
-        it = buffer.erase(it);
+        // Only what has been fed in.
+        break;
       }
-      else
+
+      long waitMs = escapeLeft;
+      if (wait && timeoutMs >= 0)
       {
-        if (kk[renderDebugPos] == *it)
-        {
-          if (++renderDebugPos == sizeof(kk)/sizeof(kk[0]))
-          {
-            renderDebug = !renderDebug;
-            renderDebugPos = 0;
-            it = buffer.erase(it);
-            buffer.insert(it, Keys::Backspace);
-            continue;
-          }
-        }
-        else
+        timeval now;
+        gettimeofday(&now, 0);
+        const long left = std::max(timeoutMs - MicrosecondsBetween(start, now) / 1000, 0L);
+        if (!left)
         {
-          renderDebugPos = 0;
+          buffer.push_back(Keys::AsyncInterrupted);
+          break;
         }
-        ++it;
+        waitMs = waitMs < 0 ? left : std::min(waitMs, left);
       }
-    }
+
+      const unsigned ready = WaitForInput(wait ? waitMs : 0);
+
+      if (ready & ReadyInterrupt)
+      {
+        char wake = WakeInterrupt;
+        read(interruptFd[0], &wake, 1);
+        buffer.push_back(wake == WakeResize ? Keys::Resize : Keys::AsyncInterrupted);
+        break;
+      }
+
+      if (!(ready & ReadyInput))
+      {
+        if (ready & ReadyApplication)
+        {
+          // The application's handlers may have changed what should be displayed.
+          buffer.push_back(Keys::AsyncInterrupted);
+          break;
+        }
+        if (!wait)
+        {
+          break;
+        }
+        // Timed out waiting for the rest of an escape sequence.
+        continue;
+      }
+
+      // Read everything that's available; a paste can be many kilobytes.
+      Flush();
+      const ssize_t n = input.ReadFrom(inFd);
+      if (n == 0)
+      {
+        // The terminal has gone away.
+        buffer.push_back(Keys::Eof);
+        break;
+      }
+      if (n < 0)
+      {
+        continue;
+      }
+      gettimeofday(&lastInput, 0);
+      if (recording)
+      {
+        recorded.clear();
+        input.CopyLast(n, recorded);
+        recording->AddInput(recorded.data(), recorded.size());
+      }
+    }
+
+    const size_t from = buffer.size();
+    while (!input.Empty())
+    {
+      if (pasting)
+      {
+        ReadPaste();
+        continue;
+      }
+      const size_t keys = buffer.size();
+      keyMap.MapKey(input.Pop(), buffer);
+      if (buffer.size() > keys && buffer.back() == Keys::Paste)
+      {
+        // The key is held back until all of the text has arrived.
+        buffer.pop_back();
+        pastes.push_back(std::string());
+        pasting = true;
+      }
+    }
+    TranslateKeys(from);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Wait up to \p timeoutMs, or forever if it's negative, for input or an interrupt. If there's an
+ *  event loop, wait in that, so that the application's fds are handled meanwhile.
+ *  \return Ready flags for what happened.
+ */
+//--------------------------------------------------------------------------------------------------
+unsigned Terminal::Internals::WaitForInput(long timeoutMs)
+{
+  if (eventLoop)
+  {
+    ready = 0;
+    const int handled = eventLoop->Wait(timeoutMs);
+    // Our own handlers set a flag each; anything else handled was the application's.
+    const int own = !!(ready & ReadyInput) + !!(ready & ReadyInterrupt);
+    return ready | (handled > own ? ReadyApplication : 0);
+  }
+
+  fd_set fds;
+  int n;
+  do
+  {
+    FD_ZERO(&fds);
+    FD_SET(inFd, &fds);
+    FD_SET(interruptFd[0], &fds);
+    timeval t = {0};
+    if (timeoutMs > 0)
+    {
+      t.tv_sec = timeoutMs / 1000;
+      t.tv_usec = timeoutMs % 1000 * 1000;
+    }
+    n = select(std::max(inFd, interruptFd[0]) + 1, &fds, 0, 0, timeoutMs < 0 ? 0 : &t);
+  } while (n == -1);
+
+  return (FD_ISSET(inFd, &fds) ? ReadyInput : 0) | (FD_ISSET(interruptFd[0], &fds) ? ReadyInterrupt : 0);
+}
+
+void Terminal::Internals::OnReady(int fd, unsigned)
+{
+  ready |= fd == interruptFd[0] ? ReadyInterrupt : ReadyInput;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Wait for input in \p loop from now on, or select() directly if it's 0.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::SetEventLoop(EventLoop *loop)
+{
+  if (Embedded())
+  {
+    return;
+  }
+  if (eventLoop)
+  {
+    eventLoop->Unwatch(inFd);
+    eventLoop->Unwatch(interruptFd[0]);
+  }
+  eventLoop = loop;
+  if (eventLoop)
+  {
+    const EventLoop::Handler handler = boost::bind(&Internals::OnReady, this, _1, _2);
+    eventLoop->Watch(inFd, EventLoop::Readable, handler);
+    eventLoop->Watch(interruptFd[0], EventLoop::Readable, handler);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! How much longer, in milliseconds, to wait for the rest of an escape sequence or the key after
+ *  Esc: 0 if it's time to give up, or -1 if we aren't waiting for one or should wait indefinitely.
+ */
+//--------------------------------------------------------------------------------------------------
+long Terminal::Internals::EscapeTimeLeft()
+{
+  if (!escapeTimeout || pasting || (!meta && !keyMap.Pending()))
+  {
+    return -1;
+  }
+  timeval now;
+  gettimeofday(&now, 0);
+  const long elapsed = MicrosecondsBetween(lastInput, now) / 1000;
+  return std::max(escapeTimeout - elapsed, 0L);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Post-process the keys in buffer from \p from onwards, in a single pass: translate Esc, Key to
+ *  Alt + Key, and watch for the code which toggles the render overlay.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::TranslateKeys(size_t from)
+{
+  size_t to = from;
+  for (size_t n = from; n < buffer.size(); ++n)
+  {
+    Key key = buffer[n];
+    if (key == Keys::Paste)
+    {
+      // Its text is waiting for it, so it mustn't become anything else.
+      meta = false;
+    }
+    else if (meta)
+    {
+      key += Keys::Alt;
+      meta = false;
+    }
+    else if (key == 27)
+    {
+      meta = true;
+      continue;
+    }
+    else if (kk[renderOverlayCodePos] == key)
+    {
+      if (++renderOverlayCodePos == sizeof(kk)/sizeof(kk[0]))
+      {
+        // Rub out the 'b' which was typed as part of the code.
+        renderOverlay = !renderOverlay;
+        renderOverlayCodePos = 0;
+        key = Keys::Backspace;
+      }
+    }
+    else
+    {
+      renderOverlayCodePos = 0;
+    }
+    buffer[to++] = key;
+  }
+  buffer.resize(to);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Move pasted text from the input buffer to the current paste, until the end of the paste or of
+ *  the input. The paste is delivered as a Keys::Paste once it's complete.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::ReadPaste()
+{
+  std::string &text = pastes.back();
+  const std::string &end = caps.pasteEnd;
+  const char last = end[end.size() - 1];
+  while (!input.Empty())
+  {
+    const char c = input.Pop();
+    text += c;
+    if (c == last && text.size() >= end.size() &&
+        text.compare(text.size() - end.size(), end.size(), end) == 0)
+    {
+      text.resize(text.size() - end.size());
+      buffer.push_back(Keys::Paste);
+      pasting = false;
+      return;
+    }
   }
 }
 
@@ -814,6 +2049,16 @@ void Terminal::WaitForKey()
   internals->DoWaitForKey(true);
 }
 
+//--------------------------------------------------------------------------------------------------
+/*! Wait for a keypress for up to \p timeoutMs, or indefinitely if it's negative. If none comes,
+ *  Keys::AsyncInterrupted is returned, as though AsyncInterruptWaitForKey() had been called.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::WaitForKey(int timeoutMs)
+{
+  internals->DoWaitForKey(true, timeoutMs);
+}
+
 bool Terminal::HaveKey()
 {
   internals->DoWaitForKey(false);
@@ -827,185 +2072,1341 @@ bool Terminal::HaveKey()
 //--------------------------------------------------------------------------------------------------
 Key Terminal::GetKey()
 {
-  // Translate Esc, Key -> Alt + Key.
   if (!internals->buffer.empty())
   {
     Key key = internals->buffer.front();
     internals->buffer.pop_front();
+    if (key == Keys::Paste)
+    {
+      internals->paste.swap(internals->pastes.front());
+      internals->pastes.pop_front();
+    }
     return key;
   }
   return 0;
 }
 
-void Terminal::AsyncInterruptWaitForKey()
+//--------------------------------------------------------------------------------------------------
+/*! Set how long to wait, in milliseconds, for the rest of an escape sequence, or for the key after
+ *  Esc, before taking what has been read so far as it stands: an unfinished sequence as individual
+ *  characters, and Esc as Keys::Escape. 0 waits indefinitely. The default is taken from ESCDELAY,
+ *  as curses does, or is 1000.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SetEscapeTimeout(int ms)
+{
+  internals->escapeTimeout = std::max(ms, 0);
+}
+
+int Terminal::GetEscapeTimeout() const
+{
+  return internals->escapeTimeout;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Wait for keys in \p loop, so that the other fds it watches are handled while WaitForKey() is
+ *  blocked. WaitForKey() returns Keys::AsyncInterrupted after any of their handlers is called, so
+ *  that whatever they changed can be displayed. 0 goes back to waiting for keys alone.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SetEventLoop(EventLoop *loop)
+{
+  internals->SetEventLoop(loop);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Pass in input read from an embedded terminal. It's mapped to keys by HaveKey() and GetKey().
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Feed(const char *data, size_t size)
+{
+  if (size)
+  {
+    internals->input.Append(data, size);
+    gettimeofday(&internals->lastInput, 0);
+    if (internals->recording)
+    {
+      internals->recording->AddInput(data, size);
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Tell an embedded terminal that its size has changed. This is reported as Keys::Resize, just as
+ *  a SIGWINCH is for the process's own terminal.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Resize(int rows, int columns)
+{
+  internals->lines = rows;
+  internals->columns = columns;
+  internals->buffer.push_back(Keys::Resize);
+  if (internals->recording)
+  {
+    internals->recording->AddResize(rows, columns);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! How long, in milliseconds, until HaveKey() gives up waiting for the rest of an escape sequence
+ *  and returns what it has as keys, or -1 if it isn't waiting for one. An application driving an
+ *  embedded terminal should call HaveKey() again after this long, if there is no input before.
+ */
+//--------------------------------------------------------------------------------------------------
+int Terminal::GetInputTimeout()
+{
+  return internals->EscapeTimeLeft();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Stop waiting for the rest of an escape sequence: the next HaveKey() takes what it has as keys,
+ *  as though the timeout had passed. For replaying a recording without waiting.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::TimeOutInput()
+{
+  if (internals->escapeTimeout)
+  {
+    internals->lastInput.tv_sec -= internals->escapeTimeout / 1000 + 1;
+  }
+}
+
+Terminal::ControlCharacters::ControlCharacters() :
+  eof('D' & 0x1f), susp('Z' & 0x1f), intr('C' & 0x1f), quit('\\' & 0x1f)
+{
+}
+
+const Terminal::ControlCharacters &Terminal::GetControlCharacters() const
+{
+  return internals->controlCharacters;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Map \p characters to their keys in place of the tty's own. For an embedded terminal standing in
+ *  for a tty whose settings are known, such as when replaying a recording of one.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SetControlCharacters(const ControlCharacters &characters)
+{
+  Internals &t = *internals;
+  t.controlCharacters = characters;
+  TermInfoScope terminfo(t.termType.c_str());
+  t.keyMap.Load(t.termType.c_str(), characters, t.caps.pasteStart);
+}
+
+bool Terminal::GetSyncOutput() const
+{
+  return !internals->caps.syncBegin.empty();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Bracket each frame with synchronized output, using DEC private mode 2026 unless terminfo
+ *  describes another way, or stop.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SetSyncOutput(bool sync)
+{
+  TerminalCaps &caps = internals->caps;
+  if (!sync)
+  {
+    caps.syncBegin.clear();
+    caps.syncEnd.clear();
+  }
+  else if (caps.syncBegin.empty())
+  {
+    caps.syncBegin = "\x1b[?2026h";
+    caps.syncEnd = "\x1b[?2026l";
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Record the terminal's input into \p recording, starting it afresh, or stop recording if it's 0.
+ *  The settings which change how the input is read, or how much is written, are recorded with it.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SetRecording(Recording *recording)
+{
+  internals->recording = 0;
+  if (recording)
+  {
+    internals->UpdateSize();
+    recording->Start(internals->termType, internals->lines, internals->columns,
+                     internals->escapeTimeout);
+    recording->SetControlCharacters(internals->controlCharacters);
+    recording->SetSyncOutput(GetSyncOutput());
+    // Input read while the terminal was being set up, and not yet handled.
+    std::string &pending = internals->recorded;
+    pending.clear();
+    internals->input.CopyLast(internals->input.Size(), pending);
+    if (!pending.empty())
+    {
+      recording->AddInput(pending.data(), pending.size());
+    }
+  }
+  internals->recording = recording;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Send \p signal to the terminal's foreground process group, as the tty would have if it hadn't
+ *  been in raw mode. Does nothing for an embedded terminal, which has no tty, or for a tty which
+ *  isn't our controlling terminal: its process groups aren't ours to signal, and a failed or
+ *  zero tcgetpgrp() would have init, or our own group, signalled instead.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SignalForeground(int signal)
+{
+  if (internals->Embedded())
+  {
+    return;
+  }
+  const int fd = internals->inFd;
+  const pid_t group = tcgetpgrp(fd);
+  const pid_t session = tcgetsid(fd);
+  if (group > 0 && session != -1 && session == getsid(0))
+  {
+    kill(-group, signal);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Get the text of the paste which GetKey() last returned as Keys::Paste. Line breaks are whatever
+ *  the terminal sent, usually \\r.
+ */
+//--------------------------------------------------------------------------------------------------
+const std::string &Terminal::GetPaste() const
+{
+  return internals->paste;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Append the given capability string to the output.
+ *  \return \c false if the capability is missing.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Terminal::Internals::Emit(const std::string &cap)
+{
+  output += cap;
+  return !cap.empty();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Write out everything assembled so far. A frame is normally emitted with a single write().
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::Flush()
+{
+  if (output.empty())
+  {
+    return;
+  }
+
+  if (outFd == STDOUT_FILENO)
+  {
+    // Anything the application printed through stdio needs to come first.
+    fflush(stdout);
+  }
+
+  if (!caps.syncBegin.empty())
+  {
+    // Have the terminal present everything at once, rather than drawing a partial frame.
+    output.insert(0, caps.syncBegin);
+    output += caps.syncEnd;
+  }
+
+  if (Embedded())
+  {
+    // There's no tty to turn line feeds into new lines.
+    for (size_t pos = output.find('\n'); pos != std::string::npos; pos = output.find('\n', pos + 2))
+    {
+      output.insert(pos, 1, '\r');
+    }
+    nextFrameStats.bytes = output.size();
+    writer(output.data(), output.size());
+  }
+  else
+  {
+    nextFrameStats.bytes = output.size();
+    nextFrameStats.writes = WriteAll(outFd, output.data(), output.size());
+  }
+  output.clear();
+  frameStats = nextFrameStats;
+  nextFrameStats = FrameStats();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Ask the terminal whether it supports synchronized output (DEC private mode 2026) with DECRQM.
+ *  The query is followed by a request for the primary device attributes, which every terminal
+ *  answers, so that we know when to stop waiting. Anything else read in the meantime is kept to be
+ *  mapped to keys later.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Terminal::Internals::ProbeSync()
 {
-  while (write(internals->interruptFd[1], "", 1) < 1 && errno == EINTR) {}
+  static const char query[] = "\x1b[?2026$p\x1b[c";
+  WriteAll(outFd, query, sizeof(query) - 1);
+
+  // Don't hold up startup for long if the terminal doesn't answer at all.
+  const long timeoutUsec = 200000;
+  timeval start, now;
+  gettimeofday(&start, 0);
+
+  std::string input;
+  int mode = 0;
+  bool answered = false;
+  while (!answered)
+  {
+    gettimeofday(&now, 0);
+    long left = timeoutUsec - ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec));
+    if (left <= 0)
+    {
+      break;
+    }
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(inFd, &fds);
+    timeval t = { left / 1000000, left % 1000000 };
+    if (select(inFd + 1, &fds, 0, 0, &t) <= 0)
+    {
+      continue;
+    }
+    char chunk[256];
+    ssize_t n = read(inFd, chunk, sizeof(chunk));
+    if (n <= 0)
+    {
+      continue;
+    }
+    input.append(chunk, n);
+
+    // Pick the replies out of what has been read: "CSI ? 2026 ; mode $ y" and "CSI ? ... c".
+    for (size_t pos = input.find("\x1b[?"); pos != std::string::npos; pos = input.find("\x1b[?", pos))
+    {
+      size_t end = pos + 3;
+      while (end < input.size() && (isdigit(input[end]) || input[end] == ';' || input[end] == '$')) { ++end; }
+      if (end == input.size())
+      {
+        break;
+      }
+      if (input[end] == 'c')
+      {
+        answered = true;
+      }
+      else if (input[end] == 'y' && input.compare(pos + 3, 5, "2026;") == 0)
+      {
+        mode = atoi(input.c_str() + pos + 8);
+      }
+      else
+      {
+        pos = end;
+        continue;
+      }
+      input.erase(pos, end + 1 - pos);
+    }
+  }
+
+  this->input.Append(input.data(), input.size());
+  // 1 and 2 mean the mode is recognized, and currently set or reset.
+  return mode == 1 || mode == 2;
+}
+
+void Terminal::AsyncInterruptWaitForKey()
+{
+  if (internals->Embedded())
+  {
+    // The application will be calling HaveKey() anyway.
+    return;
+  }
+  while (write(internals->interruptFd[1], &WakeInterrupt, 1) < 1 && errno == EINTR) {}
+}
+
+namespace
+{
+  //! Cost of a cursor movement which the terminal can't perform.
+  const int Impossible = 1 << 24;
+
+  int RepeatCost(const std::string &cap, int n)
+  {
+    return cap.empty() ? Impossible : n * cap.size();
+  }
+
+  int ParamCost(TiParamStr &cap, int n)
+  {
+    return cap.IsValid() ? cap.Get(n).size() : Impossible;
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! Count the leading bytes which are the same in \p a and \p b, up to \p max.
+   */
+  //------------------------------------------------------------------------------------------------
+  int CommonPrefix(const char *a, const char *b, int max)
+  {
+    int n = 0;
+#ifdef __SSE2__
+    for (/**/; n + 16 <= max; n += 16)
+    {
+      const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + n));
+      const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + n));
+      const unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+      if (differ)
+      {
+        return n + __builtin_ctz(differ);
+      }
+    }
+#endif
+    while (n < max && a[n] == b[n]) { ++n; }
+    return n;
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! Count the trailing bytes which are the same in the \p max bytes before \p aEnd and \p bEnd.
+   */
+  //------------------------------------------------------------------------------------------------
+  int CommonSuffix(const char *aEnd, const char *bEnd, int max)
+  {
+    int n = 0;
+#ifdef __SSE2__
+    for (/**/; n + 16 <= max; n += 16)
+    {
+      const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aEnd - n - 16));
+      const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bEnd - n - 16));
+      const unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+      if (differ)
+      {
+        // The highest differing byte is the one nearest the end.
+        return n + __builtin_clz(differ) - 16;
+      }
+    }
+#endif
+    while (n < max && aEnd[-n - 1] == bEnd[-n - 1]) { ++n; }
+    return n;
+  }
+
+  //------------------------------------------------------------------------------------------------
+  /*! Fill \p attributes with the attribute of each character of \p line.
+   */
+  //------------------------------------------------------------------------------------------------
+  void ExpandAttributes(const DecoratedText::Internals::Line &line,
+                        std::vector<const TerminalAttribute *> &attributes)
+  {
+    attributes.resize(line.size());
+    const std::vector<DecoratedText::Internals::Span> &spans = line.Spans();
+    for (size_t n = 0; n < spans.size(); ++n)
+    {
+      const int end = n + 1 < spans.size() ? spans[n + 1].start : line.size();
+      std::fill(attributes.begin() + spans[n].start, attributes.begin() + end, &spans[n].attribute);
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Get the character currently displayed at the given position, as far as we know.
+ */
+//--------------------------------------------------------------------------------------------------
+char Terminal::Internals::DisplayedChar(int line, int col)
+{
+  if (line < static_cast<int>(text.lines.size()) && col < static_cast<int>(text.lines[line].size()))
+  {
+    return text.lines[line].Char(col);
+  }
+  return ' ';
+}
+
+const TerminalAttribute &Terminal::Internals::DisplayedAttribute(int line, int col)
+{
+  if (line < static_cast<int>(text.lines.size()) && col < static_cast<int>(text.lines[line].size()))
+  {
+    return text.lines[line].AttributeAt(col);
+  }
+  return Attributes::Normal;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Find the cheapest way to move left by \p by columns.
+ *  \return The cost in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+int Terminal::Internals::PlanLeft(int by, Move &how)
+{
+  int best = ParamCost(caps.cub, by);
+  how = MoveCub;
+  int cost = RepeatCost(caps.cub1, by);
+  if (cost < best) { best = cost; how = MoveCub1; }
+  return best;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Find the cheapest way to move right from column \p from to column \p to on line \p line.
+ *  Retyping the characters in between is often cheapest for short distances.
+ *  \param drawing  The attribute the terminal will be drawing in when the move starts.
+ *  \return The cost in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+int Terminal::Internals::PlanRight(int line, int from, int to, const TerminalAttribute &drawing,
+                                   Move &how)
+{
+  int by = to - from;
+  int best = by;
+  how = MoveReprint;
+  // Retyping characters in some other attribute would mean switching attributes back and forth.
+  for (int col = from; col < to && best < Impossible; ++col)
+  {
+    if (DisplayedAttribute(line, col) != drawing)
+    {
+      best = Impossible;
+    }
+  }
+  int cost = ParamCost(caps.cuf, by);
+  if (cost < best) { best = cost; how = MoveCuf; }
+  cost = RepeatCost(caps.cuf1, by);
+  if (cost < best) { best = cost; how = MoveCuf1; }
+  return best;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Find the cheapest way to move from column \p from to column \p to on line \p line, by absolute
+ *  positioning, relative movement, or a carriage return followed by a move right.
+ *  \return The cost in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+int Terminal::Internals::PlanColumn(int line, int from, int to, const TerminalAttribute &drawing,
+                                    bool &cr, Move &how)
+{
+  cr = false;
+  how = MoveNone;
+  if (from == to)
+  {
+    return 0;
+  }
+
+  int best = ParamCost(caps.hpa, to);
+  how = MoveHpa;
+
+  Move relative;
+  int cost = (to < from ? PlanLeft(from - to, relative) : PlanRight(line, from, to, drawing, relative));
+  if (cost < best) { best = cost; how = relative; }
+
+  if (to < from && !caps.cr.empty())
+  {
+    cost = caps.cr.size();
+    relative = MoveNone;
+    if (to)
+    {
+      cost += PlanRight(line, 0, to, drawing, relative);
+    }
+    if (cost < best) { best = cost; how = relative; cr = true; }
+  }
+
+  return best;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Find the cheapest way to move up (if \p by is negative) or down without changing column.
+ *  \return The cost in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+int Terminal::Internals::PlanVertical(int by, Move &how)
+{
+  how = MoveNone;
+  int best = 0;
+  if (by < 0)
+  {
+    best = ParamCost(caps.cuu, -by);
+    how = MoveCuu;
+    int cost = RepeatCost(caps.cuu1, -by);
+    if (cost < best) { best = cost; how = MoveCuu1; }
+    if (best == Impossible && caps.bw)
+    {
+      // Backspace wraps, so columns * bs goes up one line.
+      best = RepeatCost(caps.cub1, -by * GetColumns());
+      how = MoveBackspaceWrap;
+    }
+  }
+  else if (by > 0)
+  {
+    best = ParamCost(caps.cud, by);
+    how = MoveCud;
+    // A cud1 of "\n" also moves to the start of the line.
+    if (caps.cud1 != "\n")
+    {
+      int cost = RepeatCost(caps.cud1, by);
+      if (cost < best) { best = cost; how = MoveCud1; }
+    }
+  }
+  return best;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Emit a movement chosen by one of the Plan functions.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::EmitMove(Move how, int line, int from, int to)
+{
+  int by = std::abs(to - from);
+  if (how != MoveNone && how != MoveReprint && !caps.msgr)
+  {
+    // Not safe to move the cursor in standout modes.
+    SetAttribute(Attributes::Normal);
+  }
+  switch (how)
+  {
+  case MoveNone: break;
+  case MoveHpa: Emit(caps.hpa.Get(to)); break;
+  case MoveCub: Emit(caps.cub.Get(by)); break;
+  case MoveCuf: Emit(caps.cuf.Get(by)); break;
+  case MoveCuu: Emit(caps.cuu.Get(by)); break;
+  case MoveCud: Emit(caps.cud.Get(by)); break;
+  case MoveCub1: for (int n = 0; n < by; ++n) { Emit(caps.cub1); } break;
+  case MoveCuf1: for (int n = 0; n < by; ++n) { Emit(caps.cuf1); } break;
+  case MoveCuu1: for (int n = 0; n < by; ++n) { Emit(caps.cuu1); } break;
+  case MoveCud1: for (int n = 0; n < by; ++n) { Emit(caps.cud1); } break;
+  case MoveBackspaceWrap: for (int n = 0; n < by * GetColumns(); ++n) { Emit(caps.cub1); } break;
+  case MoveReprint:
+    // PlanRight only reprints characters in the attribute it was told would be current, so this
+    // switches attribute only if that was wrong.
+    for (int col = from; col < to; ++col)
+    {
+      SetAttribute(DisplayedAttribute(line, col));
+      output += DisplayedChar(line, col);
+    }
+    break;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Move the cursor up (if \p by is negative) or down, keeping it in the same column.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Terminal::Internals::MoveVertical(int by)
+{
+  Move how;
+  if (PlanVertical(by, how) >= Impossible)
+  {
+    return false;
+  }
+  EmitMove(how, cursorLine, cursorLine, cursorLine + by);
+  cursorLine += by;
+  return true;
+}
+
+int Terminal::Internals::GetCursorCol()
+{
+  if (cursorCol == -1)
+  {
+    // Don't really care if this fails. If we print a newline here,
+    // we definitely mess up our output, whereas if we don't, we only
+    // potentially mess up.
+    Emit(caps.cr);
+    cursorCol = 0;
+  }
+  return cursorCol;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Move the cursor to the given position, using the cheapest sequence the terminal supports. Like
+ *  curses' mvcur, this compares moving vertically and then along the line, and moving down with
+ *  newlines and then right from the left margin.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Terminal::Internals::CursorTo(int line, int col)
+{
+  int from = GetCursorCol();
+  int by = line - cursorLine;
+  if (!by && col == from)
+  {
+    return true;
+  }
+
+  const int newlineCost = caps.nel.empty() ? 1 : caps.nel.size();
+  const size_t startBytes = output.size();
+
+  Move vertical, horizontal;
+  bool cr;
+  int best = Impossible;
+  // Lines we haven't written to yet may be off the bottom of the screen. Only a newline will
+  // scroll the screen to make room for them.
+  if (line < static_cast<int>(text.lines.size()))
+  {
+    best = PlanVertical(by, vertical);
+    // Moving without msgr goes back to plain text first.
+    const TerminalAttribute &drawing =
+      vertical != MoveNone && !caps.msgr ? Attributes::Normal : attribute;
+    best += PlanColumn(line, from, col, drawing, cr, horizontal);
+  }
+
+  bool newlines = false;
+  if (by > 0)
+  {
+    bool newlineCr;
+    Move newlineHorizontal;
+    // Newlines go back to plain text.
+    int cost = by * newlineCost +
+               PlanColumn(line, 0, col, Attributes::Normal, newlineCr, newlineHorizontal);
+    if (cost < best)
+    {
+      best = cost;
+      newlines = true;
+      cr = newlineCr;
+      horizontal = newlineHorizontal;
+    }
+  }
+
+  if (best >= Impossible)
+  {
+    return false;
+  }
+
+  if (newlines)
+  {
+    while (line != cursorLine)
+    {
+      WriteChar('\n');
+    }
+  }
+  else
+  {
+    EmitMove(vertical, line, cursorLine, line);
+    cursorLine = line;
+  }
+
+  if (cr)
+  {
+    Emit(caps.cr);
+    cursorCol = 0;
+  }
+  EmitMove(horizontal, line, cursorCol, col);
+  cursorCol = col;
+  nextFrameStats.moveBytes += output.size() - startBytes;
+  return true;
+}
+
+void Terminal::Internals::WriteChar(char ch, const TerminalAttribute &attribute)
+{
+  if (ch == '\n')
+  {
+    // If the screen scrolls, some terminals fill the new line with the current background.
+    SetAttribute(Attributes::Normal);
+    if (!Emit(caps.nel))
+    {
+      output += '\n';
+    }
+
+    ++cursorLine;
+    cursorCol = 0;
+  }
+  else
+  {
+    SetAttribute(attribute);
+    output += ch;
+
+    // Keep track of what's on the screen, for cursor movement to use.
+    if (cursorLine < static_cast<int>(text.lines.size()))
+    {
+      text.lines[cursorLine].Set(cursorCol, attribute, ch);
+    }
+
+    if (++cursorCol == GetColumns())
+    {
+      if (caps.xenl)
+      {
+        // Needed for predictable behaviour.
+        SetAttribute(Attributes::Normal);
+        output += '\n';
+      }
+      ++cursorLine;
+      cursorCol = 0;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Write a character which has changed since the last frame. With the render overlay on, it's drawn
+ *  on a background colour which changes every frame, so what each frame repainted stands out;
+ *  what's recorded as being on the screen is still the real attribute, so that the overlay doesn't
+ *  change what the next frame repaints.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::Repaint(char ch, const TerminalAttribute &attribute)
+{
+  ++nextFrameStats.cellsChanged;
+  if (!renderOverlay)
+  {
+    WriteChar(ch, attribute);
+    return;
+  }
+
+  TerminalAttribute highlight = attribute;
+  if (caps.setab.IsValid())
+  {
+    highlight.background = TerminalAttribute::Colour(TerminalAttribute::Red + renderOverlayFrame % 6);
+  }
+  else
+  {
+    highlight.style ^= TerminalAttribute::Reverse;
+  }
+  const int line = cursorLine, col = cursorCol;
+  WriteChar(ch, highlight);
+  if (line < static_cast<int>(text.lines.size()))
+  {
+    text.lines[line].Set(col, attribute, ch);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Switch the terminal to drawing in attribute \p to, emitting only what has changed since the
+ *  current attribute.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::SetAttribute(const TerminalAttribute &to)
+{
+  if (to == attribute)
+  {
+    return;
+  }
+
+  // There's no portable way to turn off most styles individually, so start again from plain text.
+  bool reset = (attribute.style & ~to.style) != 0;
+  if (!reset && ((to.foreground == TerminalAttribute::Default && attribute.foreground != to.foreground) ||
+                 (to.background == TerminalAttribute::Default && attribute.background != to.background)))
+  {
+    // Colours can only be put back to the default all at once.
+    if (Emit(caps.op))
+    {
+      attribute.foreground = attribute.background = TerminalAttribute::Default;
+    }
+    else
+    {
+      reset = true;
+    }
+  }
+  if (reset)
+  {
+    Emit(caps.sgr0);
+    attribute = Attributes::Normal;
+  }
+
+  const int added = to.style & ~attribute.style;
+  if (added & TerminalAttribute::Bold) { Emit(caps.bold); }
+  if (added & TerminalAttribute::Dim) { Emit(caps.dim); }
+  if (added & TerminalAttribute::Underline) { Emit(caps.smul); }
+  if (added & TerminalAttribute::Reverse) { Emit(caps.rev); }
+  if (to.foreground != attribute.foreground && caps.setaf.IsValid())
+  {
+    Emit(caps.setaf.Get(to.foreground));
+  }
+  if (to.background != attribute.background && caps.setab.IsValid())
+  {
+    Emit(caps.setab.Get(to.background));
+  }
+  attribute = to;
+}
+
+namespace
+{
+  struct WithoutCursor
+  {
+    WithoutCursor(Terminal::Internals &_terminal) : terminal(_terminal) { terminal.Emit(terminal.caps.civis); }
+    ~WithoutCursor()
+    {
+      terminal.SetAttribute(Attributes::Normal);
+      terminal.Emit(terminal.caps.cnorm);
+      terminal.Flush();
+    }
+    Terminal::Internals &terminal;
+  };
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Costs, in bytes, of inserting, deleting or clearing to the end of the line \p by characters at
+ *  the cursor. Impossible if the terminal can't do it.
+ */
+//--------------------------------------------------------------------------------------------------
+int Terminal::Internals::InsertCost(int by)
+{
+  return std::min(ParamCost(caps.ich, by), RepeatCost(caps.ich1, by));
+}
+
+int Terminal::Internals::DeleteCost(int by)
+{
+  return std::min(ParamCost(caps.dch, by), RepeatCost(caps.dch1, by));
+}
+
+int Terminal::Internals::ClearCost(int by)
+{
+  int cost = std::min(RepeatCost(caps.el, 1), ParamCost(caps.ech, by));
+  // Failing all else, overwrite with spaces.
+  return std::min(std::min(cost, DeleteCost(by)), by);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Insert \p by blank characters at the cursor, which must be at (\p line, \p col).
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::InsertChars(int line, int col, int by)
+{
+  // Inserted blanks may take on the current background colour.
+  SetAttribute(Attributes::Normal);
+  if (ParamCost(caps.ich, by) <= RepeatCost(caps.ich1, by))
+  {
+    Emit(caps.ich.Get(by));
+  }
+  else
+  {
+    for (int n = 0; n < by; ++n) { Emit(caps.ich1); }
+  }
+
+  DecoratedText::Internals::Line &row = text.lines[line];
+  if (col < static_cast<int>(row.size()))
+  {
+    row.Insert(col, by);
+    // Characters pushed past the right margin are lost.
+    if (static_cast<int>(row.size()) > GetColumns())
+    {
+      row.Resize(GetColumns());
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Delete \p by characters at the cursor, which must be at (\p line, \p col).
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::DeleteChars(int line, int col, int by)
+{
+  SetAttribute(Attributes::Normal);
+  if (ParamCost(caps.dch, by) <= RepeatCost(caps.dch1, by))
+  {
+    Emit(caps.dch.Get(by));
+  }
+  else
+  {
+    for (int n = 0; n < by; ++n) { Emit(caps.dch1); }
+  }
+
+  DecoratedText::Internals::Line &row = text.lines[line];
+  if (col < static_cast<int>(row.size()))
+  {
+    row.Erase(col, by);
+  }
 }
 
-bool Terminal::Internals::CursorLeft(int by)
+//--------------------------------------------------------------------------------------------------
+/*! Blank the last \p by characters of line \p line, starting at the cursor, which must be at
+ *  (\p line, \p col).
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::ClearToEnd(int line, int col, int by)
 {
-  if (by < 0) { return CursorRight(-by); }
-
-  if (!by) {}
-  else if (cursorCol == by && TiStr("cr")) {}
-  else if (char *hpa = GetTiStr("hpa"))
+  SetAttribute(Attributes::Normal);
+  const int cost = ClearCost(by);
+  if (cost == RepeatCost(caps.el, 1))
   {
-    putp(tparm(hpa, cursorCol - by));
+    Emit(caps.el);
   }
-  else if (char *cub = GetTiStr("cub"))
+  else if (cost == ParamCost(caps.ech, by))
   {
-    putp(tparm(cub, by));
+    Emit(caps.ech.Get(by));
   }
-  else if (char *cub1 = GetTiStr("cub1"))
+  else if (cost == DeleteCost(by))
   {
-    for (int n = 0; n < by; ++n) { putp(cub1); }
+    DeleteChars(line, col, by);
+    return;
   }
   else
   {
-    return false;
+    for (int n = 0; n < by; ++n) { WriteChar(' '); }
+    return;
   }
 
-  cursorCol -= by;
-  return true;
+  DecoratedText::Internals::Line &row = text.lines[line];
+  if (col < static_cast<int>(row.size()))
+  {
+    row.Resize(col);
+  }
 }
 
-bool Terminal::Internals::CursorRight(int by)
+//--------------------------------------------------------------------------------------------------
+/*! Append an edit to editScript, merging it with the last one if they're the same kind.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::AddEdit(Edit edit, int count)
 {
-  if (by < 0) { return CursorLeft(-by); }
-
-  if (!by) {}
-  else if (char *hpa = GetTiStr("hpa"))
-  {
-    putp(tparm(hpa, cursorCol + by));
-  }
-  else if (char *cuf = GetTiStr("cuf"))
+  if (!count)
   {
-    putp(tparm(cuf, by));
+    return;
   }
-  else if (char *cuf1 = GetTiStr("cuf1"))
+  if (!editScript.empty() && editScript.back().first == edit)
   {
-    for (int n = 0; n < by; ++n) { putp(cuf1); }
+    editScript.back().second += count;
   }
   else
   {
-    return false;
+    editScript.push_back(std::make_pair(edit, count));
   }
-
-  cursorCol += by;
-  return true;
 }
 
-bool Terminal::Internals::CursorUp(int by)
+//--------------------------------------------------------------------------------------------------
+/*! Update one line of the screen to show \p to, using the edit script with the fewest bytes.
+ *
+ *  The unchanged prefix and suffix are stripped, and the middle is aligned by dynamic programming:
+ *  each character is kept, overwritten, inserted (with ich) or deleted (with dch). Starting a run
+ *  of edits after some kept characters costs a cursor movement, and starting an insert or delete
+ *  run costs the capability string, so the cheapest script prefers a few long runs to many short
+ *  ones. If the old text runs to the end of the line, the new text can be appended to it and any
+ *  leftover old text cleared.
+ *
+ *  The script is applied in two passes: deletions right to left, then everything else left to
+ *  right. That way nothing we want to keep is pushed off the right margin by an insertion.
+ *
+ *  \return \c false if the cursor couldn't be moved to where it was needed.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Terminal::Internals::UpdateLine(int line, const DecoratedText::Internals::Line &to)
 {
-  if (by < 0) { return CursorDown(-by); }
+  const DecoratedText::Internals::Line &from = text.lines[line];
+  const int fromSize = from.size(), toSize = to.size();
+
+  // Line up the attribute of each cell, so that cells can be compared quickly.
+  ExpandAttributes(from, fromAttributes);
+  ExpandAttributes(to, toAttributes);
+  const TerminalAttribute *const *fromAttr = fromAttributes.empty() ? 0 : &fromAttributes[0];
+  const TerminalAttribute *const *toAttr = toAttributes.empty() ? 0 : &toAttributes[0];
 
-  if (!by) {}
-  else if (char *cuu = GetTiStr("cuu"))
+  int prefix = CommonPrefix(from.Chars(), to.Chars(), std::min(fromSize, toSize));
+  for (int col = 0; col < prefix; ++col)
+  {
+    if (*fromAttr[col] != *toAttr[col])
+    {
+      prefix = col;
+    }
+  }
+  if (prefix == fromSize && prefix == toSize)
   {
-    putp(tparm(cuu, by));
+    return true;
   }
-  else if (char *cuu1 = GetTiStr("cuu1"))
+
+  // A common suffix only helps if we can shift it into place.
+  const bool canInsert = InsertCost(1) < Impossible, canDelete = DeleteCost(1) < Impossible;
+  int suffix = 0;
+  if (toSize > fromSize ? canInsert : toSize < fromSize ? canDelete : true)
   {
-    for (int n = 0; n < by; ++n) { putp(cuu1); }
+    suffix = CommonSuffix(from.Chars() + fromSize, to.Chars() + toSize,
+                          std::min(fromSize, toSize) - prefix);
+    for (int n = 0; n < suffix; ++n)
+    {
+      if (*fromAttr[fromSize - 1 - n] != *toAttr[toSize - 1 - n])
+      {
+        suffix = n;
+      }
+    }
   }
-  else if (char *cub1 = HasTiFlag("bw") ? GetTiStr("cub1") : 0)
+
+  const int n = fromSize - prefix - suffix, m = toSize - prefix - suffix;
+  // Don't spend unbounded time on the alignment. Lines are no wider than the terminal, so this
+  // only matters for very wide terminals.
+  const int maxCells = 1 << 17;
+
+  editScript.clear();
+  AddEdit(EditKeep, prefix);
+  if ((n + 1) * (m + 1) > maxCells)
   {
-    // Backspace wraps, so columns * bs goes up one line.
-    for (int n = 0; n < by * GetColumns(); ++n) { putp(cub1); }
+    // Just overwrite the characters which differ.
+    for (int col = prefix; col < fromSize && col < toSize; ++col)
+    {
+      const bool same = from.Char(col) == to.Char(col) && *fromAttr[col] == *toAttr[col];
+      AddEdit(same ? EditKeep : EditWrite, 1);
+    }
+    AddEdit(EditInsert, std::max(toSize - fromSize, 0));
+    AddEdit(EditClear, std::max(fromSize - toSize, 0));
+    suffix = 0;
   }
   else
   {
-    return false;
-  }
+    // Moving the cursor somewhere on the line typically costs about this much.
+    const int moveCost = std::min(std::min(ParamCost(caps.hpa, GetColumns() / 2),
+                                           ParamCost(caps.cuf, 10)), 4);
+    const int insertOpen = caps.ich.IsValid() ? ParamCost(caps.ich, 1) : 0;
+    const int insertEach = caps.ich.IsValid() ? 0 : RepeatCost(caps.ich1, 1);
+    const int deleteOpen = caps.dch.IsValid() ? ParamCost(caps.dch, 1) : 0;
+    const int deleteEach = caps.dch.IsValid() ? 0 : RepeatCost(caps.dch1, 1);
+    // Whether the middle runs to the end of the line, so that characters can be appended to it
+    // without inserting.
+    const bool atEnd = !suffix;
+
+    // editCost[s][i * width + j] is the cheapest way to turn the first i characters of the middle
+    // of \p from into the first j of \p to, ending with an edit of kind s.
+    const int width = m + 1, cells = (n + 1) * width;
+    for (int s = 0; s < NumEditStates; ++s)
+    {
+      editCost[s].assign(cells, Impossible);
+      editPrev[s].resize(cells);
+    }
+    editCost[EditKeep][0] = 0;
 
-  cursorLine -= by;
-  return true;
-}
+    for (int i = 0; i <= n; ++i)
+    {
+      for (int j = 0; j <= m; ++j)
+      {
+        const int at = i * width + j;
+        if (i && j)
+        {
+          const int diag = at - width - 1;
+          if (from.Char(prefix + i - 1) == to.Char(prefix + j - 1) &&
+              *fromAttr[prefix + i - 1] == *toAttr[prefix + j - 1])
+          {
+            for (int s = 0; s < NumEditStates; ++s)
+            {
+              if (editCost[s][diag] < editCost[EditKeep][at])
+              {
+                editCost[EditKeep][at] = editCost[s][diag];
+                editPrev[EditKeep][at] = s;
+              }
+            }
+          }
+          for (int s = 0; s < NumEditStates; ++s)
+          {
+            int cost = editCost[s][diag] + 1 + (s == EditKeep ? moveCost : 0);
+            if (cost < editCost[EditWrite][at])
+            {
+              editCost[EditWrite][at] = cost;
+              editPrev[EditWrite][at] = s;
+            }
+          }
+        }
+        const bool append = atEnd && i == n;
+        if (j && (append || canInsert))
+        {
+          const int each = 1 + (append ? 0 : insertEach), open = (append ? 0 : insertOpen);
+          for (int s = 0; s < NumEditStates; ++s)
+          {
+            int cost = editCost[s][at - 1] + each +
+                       (s == EditInsert ? 0 : open + (s == EditKeep ? moveCost : 0));
+            if (cost < editCost[EditInsert][at])
+            {
+              editCost[EditInsert][at] = cost;
+              editPrev[EditInsert][at] = s;
+            }
+          }
+        }
+        if (i && canDelete)
+        {
+          for (int s = 0; s < NumEditStates; ++s)
+          {
+            int cost = editCost[s][at - width] + deleteEach +
+                       (s == EditDelete ? 0 : deleteOpen + (s == EditKeep ? moveCost : 0));
+            if (cost < editCost[EditDelete][at])
+            {
+              editCost[EditDelete][at] = cost;
+              editPrev[EditDelete][at] = s;
+            }
+          }
+        }
+      }
+    }
 
-bool Terminal::Internals::CursorDown(int by)
-{
-  if (by < 0) { return CursorUp(-by); }
+    // Find the cheapest way to finish: either all of the old text is accounted for, or (at the end
+    // of the line) whatever's left of it is cleared.
+    int best = Impossible, bestState = EditKeep, bestI = n;
+    for (int i = atEnd ? 0 : n; i <= n; ++i)
+    {
+      for (int s = 0; s < NumEditStates; ++s)
+      {
+        int cost = editCost[s][i * width + m];
+        if (i < n)
+        {
+          cost += ClearCost(n - i) + (s == EditKeep ? moveCost : 0);
+        }
+        if (cost < best)
+        {
+          best = cost;
+          bestState = s;
+          bestI = i;
+        }
+      }
+    }
 
-  if (!by) {}
-  else if (char *cud = GetTiStr("cud"))
-  {
-    putp(tparm(cud, by));
+    // Walk back through the table. The script comes out backwards.
+    const size_t scriptStart = editScript.size();
+    AddEdit(EditClear, n - bestI);
+    for (int i = bestI, j = m, s = bestState; i || j; /**/)
+    {
+      const int prev = editPrev[s][i * width + j];
+      AddEdit(static_cast<Edit>(s), 1);
+      if (s != EditInsert) { --i; }
+      if (s != EditDelete) { --j; }
+      s = prev;
+    }
+    std::reverse(editScript.begin() + scriptStart, editScript.end());
   }
-  else if (char *cud1 = GetTiStr("cud1"))
+  AddEdit(EditKeep, suffix);
+
+  // Pass 1: deletions, from right to left, in the old line's coordinates.
+  int col = fromSize;
+  for (size_t n = editScript.size(); n--; /**/)
   {
-    for (int n = 0; n < by; ++n) { putp(cud1); }
+    const Edit edit = editScript[n].first;
+    const int count = editScript[n].second;
+    if (edit == EditInsert)
+    {
+      continue;
+    }
+    col -= count;
+    if (edit == EditDelete || edit == EditClear)
+    {
+      if (!CursorTo(line, col))
+      {
+        return false;
+      }
+      if (edit == EditDelete)
+      {
+        DeleteChars(line, col, count);
+      }
+      else
+      {
+        ClearToEnd(line, col, count);
+      }
+      nextFrameStats.cellsChanged += count;
+    }
   }
-  else
+
+  // Pass 2: everything else, from left to right, in the new line's coordinates.
+  col = 0;
+  for (size_t n = 0; n < editScript.size(); ++n)
   {
-    return false;
+    const Edit edit = editScript[n].first;
+    const int count = editScript[n].second;
+    if (edit == EditWrite || edit == EditInsert)
+    {
+      if (!CursorTo(line, col))
+      {
+        return false;
+      }
+      // Appending to the end of what's on the screen is just writing. Appended characters don't
+      // replace anything from the old line, so they're kept as insertions in the script; writing
+      // them would throw out the columns of the deletions in pass 1.
+      if (edit == EditInsert && col < static_cast<int>(text.lines[line].size()))
+      {
+        InsertChars(line, col, count);
+      }
+      for (int end = col + count; cursorLine == line && cursorCol < end; /**/)
+      {
+        Repaint(to.Char(cursorCol), *toAttr[cursorCol]);
+      }
+    }
+    if (edit != EditDelete && edit != EditClear)
+    {
+      col += count;
+    }
   }
 
-  cursorLine += by;
   return true;
 }
 
-int Terminal::Internals::GetCursorCol()
+//--------------------------------------------------------------------------------------------------
+/*! Add a blank row below the text.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::AppendRow()
 {
-  if (cursorCol == -1)
+  const int line = text.lines.size();
+  if (cursorLine != line)
   {
-    // Don't really care if this fails. If we print a newline here,
-    // we definitely mess up our output, whereas if we don't, we only
-    // potentially mess up.
-    TiStr("cr");
-    cursorCol = 0;
+    // Possibly the first time writing to this line. Use newline rather than cursor
+    // down in order to ensure the screen scrolls down if necessary.
+    if (MoveVertical(line - cursorLine - 1))
+    {
+      WriteChar('\n');
+    }
   }
-  return cursorCol;
+  text.AddLine();
 }
 
-bool Terminal::Internals::CursorTo(int line, int col)
+//--------------------------------------------------------------------------------------------------
+/*! If \p newText has the same rows at its start and end as the text on the screen, but a different
+ *  number of rows in between, insert or delete rows (with il or dl) to move the rows at the end into
+ *  place. Otherwise, every row after the change would be repainted.
+ *
+ *  We don't know where on the screen the text is, so we can't set a scrolling region. Instead we
+ *  rely on there being nothing below the text: rows deleted from the text are replaced by blank
+ *  ones from below, and before inserting, the text is extended with blank rows (scrolling the
+ *  screen if necessary) so that only blank rows are pushed out of the bottom.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::ShiftRows(const DecoratedText::Internals &newText)
 {
-  if (line > cursorLine && col == 0)
+  typedef DecoratedText::Internals::Line Line;
+  const std::vector<Line> &from = text.lines, &to = newText.lines;
+  const int fromRows = from.size(), toRows = to.size();
+  if (fromRows == toRows)
   {
-    while (line != cursorLine)
-    {
-      WriteChar('\n');
-    }
-    return true;
+    return;
   }
-  else
+
+  int prefix = 0;
+  while (prefix < fromRows && prefix < toRows && text.SameLine(prefix, newText, prefix)) { ++prefix; }
+  int suffix = 0;
+  int saved = 0;
+  while (suffix < fromRows - prefix && suffix < toRows - prefix &&
+         text.SameLine(fromRows - 1 - suffix, newText, toRows - 1 - suffix))
   {
-    return CursorLeft(GetCursorCol() - col) && CursorUp(cursorLine - line);
+    saved += to[toRows - 1 - suffix].size();
+    ++suffix;
   }
-}
 
-void Terminal::Internals::WriteChar(char ch)
-{
-  if (ch == '\n')
+  // Shifting costs a cursor movement and the capability, and saves repainting the suffix.
+  const int by = std::abs(toRows - fromRows);
+  const int cost = toRows > fromRows ? std::min(ParamCost(caps.il, by), RepeatCost(caps.il1, by))
+                                     : std::min(ParamCost(caps.dl, by), RepeatCost(caps.dl1, by));
+  const int moveCost = 4;
+  if (!suffix || cost + moveCost >= saved)
   {
-    TiStr("nel") || putchar('\n');
+    return;
+  }
 
-    ++cursorLine;
-    cursorCol = 0;
+  if (toRows > fromRows)
+  {
+    while (static_cast<int>(text.lines.size()) < toRows)
+    {
+      AppendRow();
+    }
+    if (!CursorTo(prefix, 0))
+    {
+      return;
+    }
+    SetAttribute(Attributes::Normal);
+    if (ParamCost(caps.il, by) <= RepeatCost(caps.il1, by))
+    {
+      Emit(caps.il.Get(by));
+    }
+    else
+    {
+      for (int n = 0; n < by; ++n) { Emit(caps.il1); }
+    }
+    text.InsertLines(prefix, by);
+    text.RemoveLines(toRows);
   }
   else
   {
-    putchar(ch);
-
-    if (++cursorCol == GetColumns())
+    if (!CursorTo(prefix, 0))
     {
-      if (HasTiFlag("xenl"))
-      {
-        // Needed for predictable behaviour.
-        putchar('\n');
-      }
-      ++cursorLine;
-      cursorCol = 0;
+      return;
+    }
+    SetAttribute(Attributes::Normal);
+    if (ParamCost(caps.dl, by) <= RepeatCost(caps.dl1, by))
+    {
+      Emit(caps.dl.Get(by));
+    }
+    else
+    {
+      for (int n = 0; n < by; ++n) { Emit(caps.dl1); }
+    }
+    text.RemoveLines(prefix, prefix + by);
+    while (static_cast<int>(text.lines.size()) < fromRows)
+    {
+      text.AddLine();
     }
   }
-}
-
-namespace
-{
-  struct WithoutCursor
-  {
-    WithoutCursor() { TiStr("civis"); }
-    ~WithoutCursor() { TiStr("cnorm"); fflush(stdout); }
-  };
+  // Some terminals move the cursor to the left margin, and others leave it where it was. It was at
+  // the left margin anyway.
+  cursorCol = 0;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1014,97 +3415,97 @@ namespace
 //--------------------------------------------------------------------------------------------------
 void Terminal::SetText(const DecoratedText &_text, int cursorLine, int cursorCol)
 {
-  // Only need to bother with this on SIGWINCH, unless the terminal size changes
-  // while we're not the foreground process. But the cost is small, so let's do
-  // it anyway.
+  // This only asks the terminal if we've had SIGWINCH, or been in the background, since we last
+  // looked.
   internals->UpdateSize();
 
-  DecoratedText::Internals text = *_text.internals;
+  timeval start, laidOut;
+  gettimeofday(&start, 0);
+  DecoratedText::Internals &text = internals->back;
+  text.Assign(*_text.internals);
   text.Prepare(internals->lines, internals->columns, cursorLine, cursorCol);
+  gettimeofday(&laidOut, 0);
+
+  // SetText flushes the frame, so its statistics have to be filled in first. The time spent
+  // writing it out is counted as part of the diff.
+  FrameStats &stats = internals->nextFrameStats;
+  stats.layoutUsec = MicrosecondsBetween(start, laidOut);
   internals->SetText(text, cursorLine, cursorCol);
+  timeval done;
+  gettimeofday(&done, 0);
+  internals->frameStats.diffUsec = MicrosecondsBetween(laidOut, done);
 }
-void Terminal::Internals::SetText(const DecoratedText::Internals &newText,
-                                  int cLine, int cCol)
+
+//--------------------------------------------------------------------------------------------------
+/*! Display \p newText. Afterwards, \p newText holds the storage of the previous frame, ready to be
+ *  reused for the next one.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::Internals::SetText(DecoratedText::Internals &newText, int cLine, int cCol)
 {
-  WithoutCursor hideCursor;
+  WithoutCursor hideCursor(*this);
 
   // TODO: Handle 'os' capability somehow (no editing?).
 
-  if (renderDebug)
+  if (renderOverlay)
   {
-    static int n = 0;
-    n = (n + 1) % 12;
-    if (n < 6)
-    {
-      fputs("\x1b[1;3", stdout);
-      putchar('1' + n);
-    }
-    else
+    ++renderOverlayFrame;
+  }
+
+  // A terminal made narrower cuts its rows off at the new width and keeps the cursor inside it, so
+  // there's nothing past there left to clear.
+  for (size_t line = 0; line < text.lines.size(); ++line)
+  {
+    if (text.lines[line].size() > columns)
     {
-      fputs("\x1b[22;3", stdout);
-      putchar('1' + n - 6);
+      text.lines[line].Resize(columns);
     }
-    putchar('m');
   }
+  cursorCol = std::min(cursorCol, std::max(columns - 1, 0));
 
-  // There's a nice dynamic programming algorithm to compute an optimal set of edits
-  // to convert one line of newText into another, which we certainly could use here (if
-  // the terminal supports character insert/delete commands). For now, just do a char
-  // by char update.
+  // If rows have been inserted or removed, shift the rest into place rather than repainting them.
+  ShiftRows(newText);
+
+  // Each line is brought up to date with the cheapest edit script UpdateLine can find.
   typedef DecoratedText::Internals::Line Line;
   Line blankLine;
+  //
+  // As we go, text is updated to reflect what's on the screen, so that cursor movement can retype
+  // characters we've already written.
   for (size_t line = 0; line < newText.lines.size() || line < text.lines.size(); ++line)
   {
-    const Line &from = (line < text.lines.size() ? text.lines[line] : blankLine);
-    const Line &to = (line < newText.lines.size() ? newText.lines[line] : blankLine);
+    if (line >= text.lines.size())
+    {
+      AppendRow();
+    }
 
-    if (line >= text.lines.size() && cursorLine != line)
+    // Most rows are usually unchanged.
+    if (line < newText.lines.size() && text.SameLine(line, newText, line))
     {
-      // Possibly the first time writing to this line. Use newline rather than cursor
-      // down in order to ensure the screen scrolls down if necessary.
-      if (CursorDown(line - cursorLine - 1))
-      {
-        WriteChar('\n');
-      }
+      continue;
     }
 
-    for (size_t col = 0; col < from.size() || col < to.size(); ++col)
+    const Line &to = (line < newText.lines.size() ? newText.lines[line] : blankLine);
+    if (!UpdateLine(line, to))
     {
-      if (col >= from.size() || col >= to.size() || from[col] != to[col])
+      // About to call SetText. This should never be problematic, but better safe
+      // than stack overflow.
+      static bool alreadyHere = false;
+      if (!alreadyHere)
       {
-        // Make sure we're at or before column \p col, on the right line.
-        if (!CursorTo(line, col) && (line != cursorLine || cursorCol > col) && !CursorTo(line, 0))
-        {
-          // About to call SetText. This should never be problematic, but better safe
-          // than stack overflow.
-          static bool alreadyHere = false;
-          if (!alreadyHere)
-          {
-            alreadyHere = true;
-            Commit(true);
-            SetText(newText, cLine, cCol);
-            alreadyHere = false;
-          }
-          return;
-        }
-
-        // Copy text up to the right point. Normally this just means writing the
-        // current character, but if CursorTo fails, then we may be retyping the
-        // whole line.
-        while (cursorLine == line && cursorCol <= col)
-        {
-          WriteChar(cursorCol < to.size() ? to[cursorCol].c : ' ');
-        }
+        alreadyHere = true;
+        Commit(true);
+        SetText(newText, cLine, cCol);
+        alreadyHere = false;
       }
+      return;
     }
   }
 
   // This won't work on various types of dumb terminals. FIXME: we can fake this
   // up with \r followed by retyping the whole line.
   CursorTo(cLine, cCol);
-  text = newText;
-
-  Flush();
+  text.Swap(newText);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1113,7 +3514,8 @@ void Terminal::Internals::SetText(const DecoratedText::Internals &newText,
 //--------------------------------------------------------------------------------------------------
 /*static*/ void Terminal::Hide()
 {
-  internals->SetText(DecoratedText::Internals(), 0, 0);
+  internals->back.Clear();
+  internals->SetText(internals->back, 0, 0);
   internals->cursorCol = -1;
 }
 
@@ -1162,11 +3564,12 @@ void Terminal::Internals::Commit(bool addNewline)
     }
   }
 
+  SetAttribute(Attributes::Normal);
   Flush();
 
   // Cursor column now 'unknown'.
   cursorCol = -1;
-  text = DecoratedText::Internals();
+  text.Clear();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1180,10 +3583,10 @@ void Terminal::Internals::Commit(bool addNewline)
 }
 void Terminal::Internals::Redisplay()
 {
-  DecoratedText::Internals currText = text;
   int line = cursorLine, col = cursorCol;
 
-  if (TiStr("clear"))
+  SetAttribute(Attributes::Normal);
+  if (Emit(caps.clear))
   {
     cursorCol = 0;
     cursorLine = 0;
@@ -1198,9 +3601,98 @@ void Terminal::Internals::Redisplay()
     }
     cursorCol = -1;
   }
-  text = DecoratedText::Internals();
+  back.Swap(text);
+  text.Clear();
+
+  SetText(back, line, col);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Print \p printed above the current text, which is drawn again below it, all in one write. Lines
+ *  are separated by newlines, and one is added at the end if there isn't one. Tabs are expanded,
+ *  and other control characters dropped, so that where the cursor ends up is known.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::PrintAbove(const std::string &printed)
+{
+  internals->PrintAbove(printed);
+}
+void Terminal::Internals::PrintAbove(const std::string &printed)
+{
+  if (printed.empty())
+  {
+    return;
+  }
+  const int line = cursorLine, col = cursorCol;
+  // The frame, to be drawn again below.
+  back.Assign(text);
+
+  SetAttribute(Attributes::Normal);
+  if (!CursorTo(0, 0))
+  {
+    // Can't go back up to overwrite the text; leave it, and print below it.
+    Commit(true);
+  }
+
+  // The printed text overwrites the rows the current text was on, and scrolls the screen once it
+  // runs out of them.
+  for (size_t n = 0; n < printed.size(); ++n)
+  {
+    const char ch = printed[n];
+    if (ch == '\n')
+    {
+      // Unless the line has just wrapped onto the next row.
+      if ((cursorCol || !n || printed[n - 1] == '\n') && !ClearToEndOfLine())
+      {
+        WriteChar('\n');
+      }
+    }
+    else if (ch == '\t')
+    {
+      do { WriteChar(' '); } while (cursorCol % 8);
+    }
+    else if (static_cast<unsigned char>(ch) >= ' ')
+    {
+      WriteChar(ch);
+    }
+  }
+  if (printed[printed.size() - 1] != '\n' && cursorCol && !ClearToEndOfLine())
+  {
+    WriteChar('\n');
+  }
 
-  SetText(currText, line, col);
+  // The rows below the printed text still show the rest of the old text. They're now the first
+  // rows of the text, for SetText to bring up to date.
+  text.RemoveLines(0, std::min<size_t>(cursorLine, text.lines.size()));
+  if (text.lines.empty())
+  {
+    text.AddLine();
+  }
+  cursorLine = 0;
+  SetText(back, line, col);
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Clear the rest of the cursor's row, by writing spaces over what's known to be there if the
+ *  terminal can't clear it.
+ *
+ *  \return \c true if spaces were written up to the right margin, which leaves the cursor at the
+ *  start of the next row.
+ */
+//--------------------------------------------------------------------------------------------------
+bool Terminal::Internals::ClearToEndOfLine()
+{
+  if (Emit(caps.el) || cursorLine >= static_cast<int>(text.lines.size()))
+  {
+    return false;
+  }
+  const int line = cursorLine;
+  const int end = std::min(text.lines[line].size(), GetColumns());
+  while (cursorLine == line && cursorCol < end)
+  {
+    WriteChar(' ');
+  }
+  return cursorLine != line;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1227,8 +3719,34 @@ int Terminal::GetNumColumns()
 /*! Emit a warning bell / screen flash.
  */
 //--------------------------------------------------------------------------------------------------
-/*static*/ void Terminal::Bell()
+void Terminal::Bell()
+{
+  if (internals->Emit(internals->caps.bel))
+  {
+    internals->Flush();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Get output statistics for the most recently emitted frame.
+ */
+//--------------------------------------------------------------------------------------------------
+const Terminal::FrameStats &Terminal::GetFrameStats() const
+{
+  return internals->frameStats;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Show or hide the render overlay, which highlights the characters repainted by each frame.
+ *  Highlighting left on the screen is cleared by the next Redisplay() with the overlay hidden.
+ */
+//--------------------------------------------------------------------------------------------------
+void Terminal::SetRenderOverlay(bool show)
+{
+  internals->renderOverlay = show;
+}
+
+bool Terminal::GetRenderOverlay() const
 {
-  InitTerminal();
-  TiBell();
+  return internals->renderOverlay;
 }
@@ -5,16 +5,42 @@
 
 #include <string>
 
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 
 namespace Redline
 {
-  class TerminalAttribute;
+  //------------------------------------------------------------------------------------------------
+  /*! How text is drawn: its colours, and whether it is bold, dim, underlined or reversed.
+   */
+  //------------------------------------------------------------------------------------------------
+  class TerminalAttribute
+  {
+  public:
+    enum Colour { Default = -1, Black, Red, Green, Yellow, Blue, Magenta, Cyan, White };
+    enum Style { Plain = 0, Bold = 1, Dim = 2, Underline = 4, Reverse = 8 };
+
+    TerminalAttribute(int style = Plain, Colour foreground = Default, Colour background = Default) :
+      style(style), foreground(foreground), background(background) {}
+
+    bool operator==(const TerminalAttribute &o) const
+    {
+      return style == o.style && foreground == o.foreground && background == o.background;
+    }
+    bool operator!=(const TerminalAttribute &o) const { return !operator==(o); }
+
+    //! A combination of Style flags.
+    int style;
+    Colour foreground;
+    Colour background;
+  };
 
   namespace Attributes
   {
     extern TerminalAttribute Normal;
     extern TerminalAttribute Error;
+    //! For hints and other text which is less important than what the user typed.
+    extern TerminalAttribute Hint;
   }
 
   //------------------------------------------------------------------------------------------------
@@ -28,6 +54,8 @@ namespace Redline
     ~DecoratedText();
 
     void Add(const TerminalAttribute &attribute, const std::string &text);
+    //! Remove all of the text, keeping the storage to be reused.
+    void Clear();
 
     class Internals;
   private:
@@ -51,8 +79,9 @@ namespace Redline
   };
 
   //------------------------------------------------------------------------------------------------
-  /*! A terminal, with the ability to read keys and output text. At the moment, only a single
-   *  terminal is supported.
+  /*! A terminal, with the ability to read keys and output text. It's on a tty, by default the
+   *  process's own, or embedded, with its I/O done by the application. Each has its own
+   *  capabilities, so there can be any number, of different types.
    */
   //------------------------------------------------------------------------------------------------
   class Terminal : boost::noncopyable
@@ -61,9 +90,19 @@ namespace Redline
     Terminal();
     ~Terminal();
 
+    //! A terminal on the tty open as \p inFd and \p outFd, of type \p termType, or $TERM.
+    Terminal(int inFd, int outFd, const std::string &termType = std::string());
+
+    //! Receives output for an embedded terminal.
+    typedef boost::function<void(const char *data, size_t size)> Writer;
+    //! An embedded terminal of type \p termType, whose I/O is done by the application.
+    Terminal(const std::string &termType, int rows, int columns, const Writer &writer);
+
   public:
     //! Blocking wait for a keypress.
     void WaitForKey();
+    //! Blocking wait for a keypress, for up to \p timeoutMs.
+    void WaitForKey(int timeoutMs);
 
     //! Non-blocking check for keys.
     bool HaveKey();
@@ -71,9 +110,52 @@ namespace Redline
     //! Non-blocking grab of current key.
     Key GetKey();
 
+    //! The text pasted, when GetKey() returns Keys::Paste.
+    const std::string &GetPaste() const;
+
+    //! How long to wait for the rest of an escape sequence, in milliseconds.
+    void SetEscapeTimeout(int ms);
+    int GetEscapeTimeout() const;
+
     //! Interrupt WaitForKey().
     void AsyncInterruptWaitForKey();
 
+    //! Wait for keys in \p loop, alongside the application's fds; 0 to wait for keys alone.
+    void SetEventLoop(EventLoop *loop);
+
+    //! Embedded terminals: pass in input, and report a change of size.
+    //@{
+    void Feed(const char *data, size_t size);
+    void Resize(int rows, int columns);
+    //@}
+
+    //! Milliseconds until a half-read escape sequence times out, or -1.
+    int GetInputTimeout();
+    //! Time out a half-read escape sequence now.
+    void TimeOutInput();
+
+    //! The tty's control characters, which are read as Keys::Eof, Keys::Suspend, Keys::Interrupt
+    //! and Keys::Quit. Without a tty, they're the usual ^D, ^Z, ^C and ^\.
+    struct ControlCharacters
+    {
+      ControlCharacters();
+      int eof, susp, intr, quit;
+    };
+    const ControlCharacters &GetControlCharacters() const;
+    void SetControlCharacters(const ControlCharacters &characters);
+
+    //! Whether each frame is bracketed with synchronized output, as terminfo describes, or as the
+    //! terminal said it supports when asked.
+    bool GetSyncOutput() const;
+    void SetSyncOutput(bool sync);
+
+    //! Record the input into \p recording, or stop if it's 0.
+    void SetRecording(Recording *recording);
+
+    //! Signal the terminal's foreground process group, if it has one and it's our controlling
+    //! terminal.
+    void SignalForeground(int signal);
+
     //! Set the currently-visible terminal text.
     void SetText(const DecoratedText &text, int cursorLine, int cursorCol);
 
@@ -86,6 +168,9 @@ namespace Redline
     //! Redisplay the current text.
     void Redisplay();
 
+    //! Print lines of \p text above the current text.
+    void PrintAbove(const std::string &text);
+
     //! Get the height of the terminal.
     int GetNumRows();
 
@@ -93,7 +178,32 @@ namespace Redline
     int GetNumColumns();
 
     //! Emit a warning bell.
-    static void Bell();
+    void Bell();
+
+    //! Output statistics for one frame.
+    struct FrameStats
+    {
+      FrameStats() : bytes(), writes(), cellsChanged(), moveBytes(), layoutUsec(), diffUsec() {}
+      //! Bytes written to the terminal.
+      size_t bytes;
+      //! Number of write() calls used to write them.
+      size_t writes;
+      //! Characters written, inserted, deleted or cleared to bring the screen up to date.
+      size_t cellsChanged;
+      //! Bytes of the output spent moving the cursor.
+      size_t moveBytes;
+      //! Time spent laying out the text for the terminal, in microseconds.
+      long layoutUsec;
+      //! Time spent working out and assembling the output, in microseconds.
+      long diffUsec;
+    };
+
+    //! Get output statistics for the most recently emitted frame.
+    const FrameStats &GetFrameStats() const;
+
+    //! Highlight the characters repainted by each frame, cycling the colour from frame to frame.
+    void SetRenderOverlay(bool show);
+    bool GetRenderOverlay() const;
 
     class Internals;
   private:
@@ -0,0 +1,834 @@
+#include "redline/virtual-terminal.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+using namespace Redline;
+
+namespace
+{
+  //------------------------------------------------------------------------------------------------
+  /*! One character on the screen, and the attribute it was drawn with.
+   */
+  //------------------------------------------------------------------------------------------------
+  struct Cell
+  {
+    Cell() : c(' ') {}
+    Cell(char c, const TerminalAttribute &attribute) : c(c), attribute(attribute) {}
+
+    char c;
+    TerminalAttribute attribute;
+  };
+
+  typedef std::vector<Cell> Row;
+
+  //! Milliseconds since some arbitrary point.
+  long long Now()
+  {
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+  }
+
+  long long NowUsec()
+  {
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+  }
+}
+
+class VirtualTerminal::Internals
+{
+public:
+  Internals(int rows, int columns);
+  ~Internals();
+
+  //! Interpret a write, timing it.
+  void Feed(const char *data, size_t size);
+  void Feed(char c);
+  void Resize(int rows, int columns);
+
+  bool Spawn(const boost::function<void()> &child, const std::string &termType);
+  void Drain(int quietMs);
+  void Close();
+
+  std::vector<Row> screen;
+  int rows, columns;
+  int cursorRow, cursorCol;
+  //! The cursor is past the last column; the next character wraps to the next line.
+  bool pendingWrap;
+  int scrollTop, scrollBottom;
+  int savedRow, savedCol;
+  TerminalAttribute attribute;
+  Stats stats;
+
+  //! The master side of the pseudo-terminal, and the process on the other side of it.
+  int master;
+  pid_t child;
+
+private:
+  enum ParseState { Ground, Escape, EscapeIntermediate, Csi, Osc, OscEscape };
+
+  Row BlankRow() const { return Row(columns); }
+  void Put(char c);
+  void LineFeed();
+  void ScrollUp(int top, int bottom, int by);
+  void ScrollDown(int top, int bottom, int by);
+  void Blank(int row, int from, int to);
+  void EscapeFinal(char c);
+  void CsiFinal(char c);
+  void SelectGraphicRendition();
+  int Param(size_t n, int def) const;
+  void Unknown();
+
+  ParseState state;
+  //! The parameters, private marker and intermediate characters of the sequence being parsed.
+  std::vector<int> params;
+  char privateMarker;
+  std::string intermediates;
+};
+
+VirtualTerminal::Internals::Internals(int rows, int columns) :
+  rows(), columns(), cursorRow(), cursorCol(), pendingWrap(), scrollTop(), scrollBottom(),
+  savedRow(), savedCol(), master(-1), child(-1), state(Ground), privateMarker()
+{
+  Resize(rows, columns);
+}
+
+VirtualTerminal::Internals::~Internals()
+{
+  Close();
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Change the size of the screen. Rows and columns which no longer fit are lost from the bottom
+ *  and right, as most terminals do; the scrolling region is reset.
+ */
+//--------------------------------------------------------------------------------------------------
+void VirtualTerminal::Internals::Resize(int newRows, int newColumns)
+{
+  rows = std::max(newRows, 1);
+  columns = std::max(newColumns, 1);
+  screen.resize(rows);
+  for (size_t n = 0; n < screen.size(); ++n)
+  {
+    screen[n].resize(columns);
+  }
+  cursorRow = std::min(cursorRow, rows - 1);
+  cursorCol = std::min(cursorCol, columns - 1);
+  pendingWrap = false;
+  scrollTop = 0;
+  scrollBottom = rows - 1;
+
+  if (master >= 0)
+  {
+    winsize size;
+    memset(&size, 0, sizeof(size));
+    size.ws_row = rows;
+    size.ws_col = columns;
+    ioctl(master, TIOCSWINSZ, &size);
+  }
+}
+
+void VirtualTerminal::Internals::Feed(const char *data, size_t size)
+{
+  const long long started = NowUsec();
+  for (size_t n = 0; n < size; ++n)
+  {
+    Feed(data[n]);
+  }
+  stats.usec += NowUsec() - started;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Interpret one byte of output. The parser keeps its state between calls, so sequences can be
+ *  split across any number of writes.
+ */
+//--------------------------------------------------------------------------------------------------
+void VirtualTerminal::Internals::Feed(char c)
+{
+  ++stats.bytes;
+
+  // C0 controls act in the middle of escape sequences too.
+  if (state != Osc && state != OscEscape)
+  {
+    switch (c)
+    {
+    case '\x1b':
+      ++stats.sequences;
+      state = Escape;
+      params.clear();
+      privateMarker = 0;
+      intermediates.clear();
+      return;
+    case '\r':
+      ++stats.sequences;
+      cursorCol = 0;
+      pendingWrap = false;
+      return;
+    case '\n':
+    case '\v':
+    case '\f':
+      ++stats.sequences;
+      pendingWrap = false;
+      LineFeed();
+      return;
+    case '\b':
+      ++stats.sequences;
+      pendingWrap = false;
+      cursorCol = std::max(cursorCol - 1, 0);
+      return;
+    case '\t':
+      ++stats.sequences;
+      pendingWrap = false;
+      cursorCol = std::min((cursorCol / 8 + 1) * 8, columns - 1);
+      return;
+    case '\a':
+      ++stats.sequences;
+      return;
+    case '\x18':
+    case '\x1a':
+      state = Ground;
+      return;
+    default:
+      if (static_cast<unsigned char>(c) < ' ')
+      {
+        return;
+      }
+    }
+  }
+
+  switch (state)
+  {
+  case Ground:
+    Put(c);
+    break;
+
+  case Escape:
+    if (c == '[')
+    {
+      state = Csi;
+    }
+    else if (c == ']')
+    {
+      state = Osc;
+    }
+    else if (c >= ' ' && c <= '/')
+    {
+      intermediates += c;
+      state = EscapeIntermediate;
+    }
+    else
+    {
+      state = Ground;
+      EscapeFinal(c);
+    }
+    break;
+
+  case EscapeIntermediate:
+    if (c >= ' ' && c <= '/')
+    {
+      intermediates += c;
+    }
+    else
+    {
+      // Character set designations, such as "ESC ( B", don't change anything we track.
+      state = Ground;
+      if (intermediates != "(" && intermediates != ")")
+      {
+        Unknown();
+      }
+    }
+    break;
+
+  case Csi:
+    if (c >= '0' && c <= '9')
+    {
+      if (params.empty())
+      {
+        params.push_back(0);
+      }
+      params.back() = std::min(params.back() * 10 + (c - '0'), 65535);
+    }
+    else if (c == ';')
+    {
+      if (params.empty())
+      {
+        params.push_back(0);
+      }
+      params.push_back(0);
+    }
+    else if (c >= '<' && c <= '?')
+    {
+      privateMarker = c;
+    }
+    else if (c >= ' ' && c <= '/')
+    {
+      intermediates += c;
+    }
+    else
+    {
+      state = Ground;
+      CsiFinal(c);
+    }
+    break;
+
+  case Osc:
+    // Titles and the like: ignore everything up to BEL or ST.
+    if (c == '\a')
+    {
+      state = Ground;
+    }
+    else if (c == '\x1b')
+    {
+      state = OscEscape;
+    }
+    break;
+
+  case OscEscape:
+    state = c == '\\' ? Ground : Osc;
+    break;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Write a printable character at the cursor. Like xterm, writing in the last column leaves the
+ *  cursor there, and the line only wraps when the next character is written.
+ */
+//--------------------------------------------------------------------------------------------------
+void VirtualTerminal::Internals::Put(char c)
+{
+  if (pendingWrap)
+  {
+    cursorCol = 0;
+    pendingWrap = false;
+    LineFeed();
+  }
+  screen[cursorRow][cursorCol] = Cell(c, attribute);
+  if (cursorCol == columns - 1)
+  {
+    pendingWrap = true;
+  }
+  else
+  {
+    ++cursorCol;
+  }
+}
+
+void VirtualTerminal::Internals::LineFeed()
+{
+  if (cursorRow == scrollBottom)
+  {
+    ScrollUp(scrollTop, scrollBottom, 1);
+  }
+  else if (cursorRow < rows - 1)
+  {
+    ++cursorRow;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Scroll rows \p top to \p bottom, inclusive, up or down by \p by rows, blanking the rows which
+ *  are exposed.
+ */
+//--------------------------------------------------------------------------------------------------
+void VirtualTerminal::Internals::ScrollUp(int top, int bottom, int by)
+{
+  by = std::min(by, bottom - top + 1);
+  std::rotate(screen.begin() + top, screen.begin() + top + by, screen.begin() + bottom + 1);
+  for (int row = bottom - by + 1; row <= bottom; ++row)
+  {
+    screen[row] = BlankRow();
+  }
+}
+
+void VirtualTerminal::Internals::ScrollDown(int top, int bottom, int by)
+{
+  by = std::min(by, bottom - top + 1);
+  std::rotate(screen.begin() + top, screen.begin() + bottom + 1 - by, screen.begin() + bottom + 1);
+  for (int row = top; row < top + by; ++row)
+  {
+    screen[row] = BlankRow();
+  }
+}
+
+//! Blank columns \p from to \p to, exclusive, of row \p row.
+void VirtualTerminal::Internals::Blank(int row, int from, int to)
+{
+  std::fill(screen[row].begin() + std::max(from, 0), screen[row].begin() + std::min(to, columns),
+            Cell());
+}
+
+void VirtualTerminal::Internals::EscapeFinal(char c)
+{
+  switch (c)
+  {
+  case 'E':
+    cursorCol = 0;
+    pendingWrap = false;
+    LineFeed();
+    break;
+  case 'D':
+    pendingWrap = false;
+    LineFeed();
+    break;
+  case 'M':
+    pendingWrap = false;
+    if (cursorRow == scrollTop)
+    {
+      ScrollDown(scrollTop, scrollBottom, 1);
+    }
+    else if (cursorRow > 0)
+    {
+      --cursorRow;
+    }
+    break;
+  case '7':
+    savedRow = cursorRow;
+    savedCol = cursorCol;
+    break;
+  case '8':
+    cursorRow = savedRow;
+    cursorCol = savedCol;
+    pendingWrap = false;
+    break;
+  case '=':
+  case '>':
+    // Keypad modes don't affect output.
+    break;
+  default:
+    Unknown();
+  }
+}
+
+//! Get parameter \p n of the current sequence, or \p def if it's missing or zero.
+int VirtualTerminal::Internals::Param(size_t n, int def) const
+{
+  return n < params.size() && params[n] ? params[n] : def;
+}
+
+void VirtualTerminal::Internals::CsiFinal(char c)
+{
+  if (privateMarker)
+  {
+    // Private modes (?25h, ?2004h, ?2026h, ...) and queries: nothing that affects the screen.
+    if (privateMarker != '?' || (c != 'h' && c != 'l' && c != 'p'))
+    {
+      Unknown();
+    }
+    return;
+  }
+  if (!intermediates.empty())
+  {
+    Unknown();
+    return;
+  }
+
+  const int n = Param(0, 1);
+  if (c != 'm')
+  {
+    pendingWrap = false;
+  }
+  switch (c)
+  {
+  case 'A':
+    cursorRow = std::max(cursorRow - n, cursorRow >= scrollTop ? scrollTop : 0);
+    break;
+  case 'B':
+    cursorRow = std::min(cursorRow + n, cursorRow <= scrollBottom ? scrollBottom : rows - 1);
+    break;
+  case 'C':
+    cursorCol = std::min(cursorCol + n, columns - 1);
+    break;
+  case 'D':
+    cursorCol = std::max(cursorCol - n, 0);
+    break;
+  case 'G':
+  case '`':
+    cursorCol = std::min(n, columns) - 1;
+    break;
+  case 'd':
+    cursorRow = std::min(n, rows) - 1;
+    break;
+  case 'H':
+  case 'f':
+    cursorRow = std::min(n, rows) - 1;
+    cursorCol = std::min(Param(1, 1), columns) - 1;
+    break;
+  case 'K':
+    switch (Param(0, 0))
+    {
+    case 0: Blank(cursorRow, cursorCol, columns); break;
+    case 1: Blank(cursorRow, 0, cursorCol + 1); break;
+    default: Blank(cursorRow, 0, columns); break;
+    }
+    break;
+  case 'J':
+    switch (Param(0, 0))
+    {
+    case 0:
+      Blank(cursorRow, cursorCol, columns);
+      for (int row = cursorRow + 1; row < rows; ++row) { Blank(row, 0, columns); }
+      break;
+    case 1:
+      for (int row = 0; row < cursorRow; ++row) { Blank(row, 0, columns); }
+      Blank(cursorRow, 0, cursorCol + 1);
+      break;
+    default:
+      for (int row = 0; row < rows; ++row) { Blank(row, 0, columns); }
+      break;
+    }
+    break;
+  case '@':
+    {
+      Row &row = screen[cursorRow];
+      const int by = std::min(n, columns - cursorCol);
+      std::copy_backward(row.begin() + cursorCol, row.end() - by, row.end());
+      Blank(cursorRow, cursorCol, cursorCol + by);
+    }
+    break;
+  case 'P':
+    {
+      Row &row = screen[cursorRow];
+      const int by = std::min(n, columns - cursorCol);
+      std::copy(row.begin() + cursorCol + by, row.end(), row.begin() + cursorCol);
+      Blank(cursorRow, columns - by, columns);
+    }
+    break;
+  case 'X':
+    Blank(cursorRow, cursorCol, cursorCol + n);
+    break;
+  case 'L':
+    if (cursorRow >= scrollTop && cursorRow <= scrollBottom)
+    {
+      ScrollDown(cursorRow, scrollBottom, n);
+      cursorCol = 0;
+    }
+    break;
+  case 'M':
+    if (cursorRow >= scrollTop && cursorRow <= scrollBottom)
+    {
+      ScrollUp(cursorRow, scrollBottom, n);
+      cursorCol = 0;
+    }
+    break;
+  case 'S':
+    ScrollUp(scrollTop, scrollBottom, n);
+    break;
+  case 'T':
+    ScrollDown(scrollTop, scrollBottom, n);
+    break;
+  case 'r':
+    {
+      const int top = Param(0, 1) - 1, bottom = std::min(Param(1, rows), rows) - 1;
+      if (top < bottom)
+      {
+        scrollTop = top;
+        scrollBottom = bottom;
+        cursorRow = cursorCol = 0;
+      }
+    }
+    break;
+  case 'm':
+    SelectGraphicRendition();
+    break;
+  case 'h':
+  case 'l':
+  case 'c':
+  case 'n':
+    // Modes and reports: nothing that affects the screen.
+    break;
+  default:
+    Unknown();
+  }
+}
+
+void VirtualTerminal::Internals::SelectGraphicRendition()
+{
+  if (params.empty())
+  {
+    params.push_back(0);
+  }
+  for (size_t n = 0; n < params.size(); ++n)
+  {
+    const int p = params[n];
+    if (p == 0) { attribute = TerminalAttribute(); }
+    else if (p == 1) { attribute.style |= TerminalAttribute::Bold; }
+    else if (p == 2) { attribute.style |= TerminalAttribute::Dim; }
+    else if (p == 4) { attribute.style |= TerminalAttribute::Underline; }
+    else if (p == 7) { attribute.style |= TerminalAttribute::Reverse; }
+    else if (p == 22) { attribute.style &= ~(TerminalAttribute::Bold | TerminalAttribute::Dim); }
+    else if (p == 24) { attribute.style &= ~TerminalAttribute::Underline; }
+    else if (p == 27) { attribute.style &= ~TerminalAttribute::Reverse; }
+    else if (p >= 30 && p <= 37) { attribute.foreground = TerminalAttribute::Colour(p - 30); }
+    else if (p == 39) { attribute.foreground = TerminalAttribute::Default; }
+    else if (p >= 40 && p <= 47) { attribute.background = TerminalAttribute::Colour(p - 40); }
+    else if (p == 49) { attribute.background = TerminalAttribute::Default; }
+    else { Unknown(); }
+  }
+}
+
+void VirtualTerminal::Internals::Unknown()
+{
+  ++stats.unknownSequences;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Start \p run in a child process, on the slave side of a new pseudo-terminal.
+ */
+//--------------------------------------------------------------------------------------------------
+bool VirtualTerminal::Internals::Spawn(const boost::function<void()> &run,
+                                                const std::string &termType)
+{
+  Close();
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0)
+  {
+    return false;
+  }
+  const char *slaveName = 0;
+  if (grantpt(master) != 0 || unlockpt(master) != 0 || !(slaveName = ptsname(master)))
+  {
+    close(master);
+    master = -1;
+    return false;
+  }
+  const std::string slave = slaveName;
+  Resize(rows, columns);
+
+  child = fork();
+  if (child < 0)
+  {
+    close(master);
+    master = -1;
+    return false;
+  }
+  if (!child)
+  {
+    // The child: make the pseudo-terminal our controlling terminal, and run.
+    setsid();
+    int fd = open(slave.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+      _exit(127);
+    }
+#ifdef TIOCSCTTY
+    ioctl(fd, TIOCSCTTY, 0);
+#endif
+    dup2(fd, 0);
+    dup2(fd, 1);
+    if (fd > 1)
+    {
+      close(fd);
+    }
+    close(master);
+    setenv("TERM", termType.c_str(), 1);
+    run();
+    _exit(0);
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/*! Read and interpret everything the child writes, until it writes nothing for \p quietMs or exits.
+ */
+//--------------------------------------------------------------------------------------------------
+void VirtualTerminal::Internals::Drain(int quietMs)
+{
+  if (master < 0)
+  {
+    return;
+  }
+  char buffer[4096];
+  for (long long deadline = Now() + quietMs; /**/; /**/)
+  {
+    const long long wait = std::max(deadline - Now(), 0LL);
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(master, &fds);
+    timeval timeout;
+    timeout.tv_sec = wait / 1000;
+    timeout.tv_usec = (wait % 1000) * 1000;
+    const int ready = select(master + 1, &fds, 0, 0, &timeout);
+    if (ready < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (ready <= 0)
+    {
+      return;
+    }
+    const ssize_t got = read(master, buffer, sizeof(buffer));
+    if (got <= 0)
+    {
+      // The child has gone away.
+      return;
+    }
+    Feed(buffer, got);
+    deadline = Now() + quietMs;
+  }
+}
+
+void VirtualTerminal::Internals::Close()
+{
+  if (child > 0)
+  {
+    kill(child, SIGKILL);
+    while (waitpid(child, 0, 0) < 0 && errno == EINTR) {}
+    child = -1;
+  }
+  if (master >= 0)
+  {
+    close(master);
+    master = -1;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// VirtualTerminal
+//--------------------------------------------------------------------------------------------------
+
+VirtualTerminal::VirtualTerminal(int rows, int columns) :
+  internals(new Internals(rows, columns))
+{
+}
+
+VirtualTerminal::~VirtualTerminal()
+{
+  delete internals;
+}
+
+void VirtualTerminal::Feed(const char *data, size_t size)
+{
+  internals->Feed(data, size);
+}
+
+void VirtualTerminal::Resize(int rows, int columns)
+{
+  internals->Resize(rows, columns);
+  if (internals->child > 0)
+  {
+    kill(internals->child, SIGWINCH);
+  }
+}
+
+int VirtualTerminal::GetRows() const
+{
+  return internals->rows;
+}
+
+int VirtualTerminal::GetColumns() const
+{
+  return internals->columns;
+}
+
+int VirtualTerminal::GetCursorRow() const
+{
+  return internals->cursorRow;
+}
+
+int VirtualTerminal::GetCursorColumn() const
+{
+  return internals->cursorCol;
+}
+
+std::string VirtualTerminal::GetRow(int row) const
+{
+  std::string text;
+  if (row < 0 || row >= internals->rows)
+  {
+    return text;
+  }
+  const Row &cells = internals->screen[row];
+  size_t end = cells.size();
+  while (end && cells[end - 1].c == ' ') { --end; }
+  text.reserve(end);
+  for (size_t n = 0; n < end; ++n)
+  {
+    text += cells[n].c;
+  }
+  return text;
+}
+
+std::string VirtualTerminal::GetScreen() const
+{
+  std::string screen;
+  int last = internals->rows;
+  while (last && GetRow(last - 1).empty()) { --last; }
+  for (int row = 0; row < last; ++row)
+  {
+    if (row)
+    {
+      screen += '\n';
+    }
+    screen += GetRow(row);
+  }
+  return screen;
+}
+
+const TerminalAttribute &VirtualTerminal::GetAttribute(int row, int column) const
+{
+  if (row < 0 || row >= internals->rows || column < 0 || column >= internals->columns)
+  {
+    return Attributes::Normal;
+  }
+  return internals->screen[row][column].attribute;
+}
+
+const VirtualTerminal::Stats &VirtualTerminal::GetStats() const
+{
+  return internals->stats;
+}
+
+void VirtualTerminal::ResetStats()
+{
+  internals->stats = Stats();
+}
+
+bool VirtualTerminal::Spawn(const boost::function<void()> &child,
+                                     const std::string &termType)
+{
+  return internals->Spawn(child, termType);
+}
+
+void VirtualTerminal::Send(const std::string &input)
+{
+  for (size_t done = 0; internals->master >= 0 && done < input.size(); /**/)
+  {
+    const ssize_t wrote = write(internals->master, input.data() + done, input.size() - done);
+    if (wrote < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (wrote <= 0)
+    {
+      break;
+    }
+    done += wrote;
+  }
+}
+
+void VirtualTerminal::Drain(int quietMs)
+{
+  internals->Drain(quietMs);
+}
+
+void VirtualTerminal::Close()
+{
+  internals->Close();
+}
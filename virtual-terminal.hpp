@@ -0,0 +1,80 @@
+#ifndef REDLINE_VIRTUAL_TERMINAL_HPP_INCLUDED
+#define REDLINE_VIRTUAL_TERMINAL_HPP_INCLUDED
+
+#include "redline/forward-decls.hpp"
+#include "redline/terminal.hpp"
+
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace Redline
+{
+  //------------------------------------------------------------------------------------------------
+  /*! A headless terminal emulator. It interprets what a program writes to the terminal into a grid
+   *  of characters, so that tests can check what is on the screen and benchmarks can count what it
+   *  cost to get it there. It understands the xterm-style sequences used by the common terminfo
+   *  entries (xterm, vt100, screen, linux).
+   */
+  //------------------------------------------------------------------------------------------------
+  class VirtualTerminal : boost::noncopyable
+  {
+  public:
+    VirtualTerminal(int rows, int columns);
+    ~VirtualTerminal();
+
+    //! Interpret output written to the terminal.
+    void Feed(const char *data, size_t size);
+    void Feed(const std::string &data) { Feed(data.data(), data.size()); }
+
+    //! Change the size of the screen, keeping what fits.
+    void Resize(int rows, int columns);
+
+    int GetRows() const;
+    int GetColumns() const;
+    int GetCursorRow() const;
+    int GetCursorColumn() const;
+
+    //! Get the text of one row, without trailing spaces.
+    std::string GetRow(int row) const;
+    //! Get the text of the screen, one line per row, without trailing blank rows.
+    std::string GetScreen() const;
+    //! Get the attribute a cell was drawn in.
+    const TerminalAttribute &GetAttribute(int row, int column) const;
+
+    //! What has been fed to the terminal, since it was created or the statistics were reset.
+    struct Stats
+    {
+      Stats() : bytes(), sequences(), unknownSequences(), usec() {}
+      //! Bytes interpreted.
+      size_t bytes;
+      //! Control characters and escape sequences interpreted.
+      size_t sequences;
+      //! Escape sequences which weren't understood, and were ignored.
+      size_t unknownSequences;
+      //! Time spent interpreting, in microseconds.
+      long usec;
+    };
+    const Stats &GetStats() const;
+    void ResetStats();
+
+    //! Run \p child in a new process whose standard input and output are a pseudo-terminal the
+    //! size of this one, with TERM set to \p termType. Its output is interpreted by Drain().
+    /*! \return \c false if the process couldn't be started.
+     */
+    bool Spawn(const boost::function<void()> &child, const std::string &termType = "xterm");
+    //! Send input to the spawned process, as if it were typed.
+    void Send(const std::string &input);
+    //! Interpret output from the spawned process until it has been quiet for \p quietMs.
+    void Drain(int quietMs);
+    //! Kill the spawned process, if it is still running, and wait for it.
+    void Close();
+
+    class Internals;
+  private:
+    Internals *internals;
+  };
+}
+
+#endif